@@ -0,0 +1,666 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_LINEAR 64 /**< Latencies below this many ns get a bucket each */
+#define HIST_SUB_BITS 4 /**< Sub-buckets per power of two above that, as a power of two */
+#define HIST_BUCKETS (HIST_LINEAR + 64 * (1 << HIST_SUB_BITS)) /**< Buckets in a latency histogram */
+
+#define MAX_THREADS 64 /**< Upper bound for --threads */
+
+/**
+ * Latency histogram of one thread, log-linear with about 6% resolution
+ */
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS]; /**< Calls per latency bucket */
+    uint64_t total; /**< Calls recorded */
+} histogram;
+
+/**
+ * Settings and shared state of one benchmark run
+ */
+typedef struct run {
+    const allocator *alloc; /**< The allocator under test */
+    unsigned threads; /**< Worker threads */
+    uint64_t ops; /**< Allocator calls per thread, roughly */
+    uint64_t seed; /**< Seed of every random stream */
+    histogram hist; /**< Merged latencies of all threads */
+    pthread_mutex_t lock; /**< Protects hist and live_bytes */
+    uint64_t live_bytes; /**< Bytes the workload holds when it measures fragmentation */
+    size_t rss_at_live; /**< Resident bytes at that point */
+} run;
+
+/**
+ * State of one worker thread
+ */
+typedef struct worker {
+    run *r; /**< The run the worker belongs to */
+    unsigned id; /**< Index of the worker */
+    uint64_t rng; /**< Random stream of the worker */
+    histogram hist; /**< Latencies of the worker's calls */
+    void *arg; /**< Workload specific data */
+} worker;
+
+/**
+ * A workload, run by every worker thread of a run
+ */
+typedef struct workload {
+    const char *name; /**< Name used on the command line and in the results */
+    unsigned rounds; /**< Generations of threads, each picking up where the last one stopped */
+    void (*setup)(run *r, worker *workers); /**< Prepares the workers, may be NULL */
+    void *(*thread)(void *arg); /**< Body of a worker thread, gets its worker */
+    void (*teardown)(run *r, worker *workers); /**< Measures and frees what is left, may be NULL */
+} workload;
+
+/**
+ * Draw the next number of a xorshift64* stream
+ *
+ * @param state The stream
+ * @return A pseudo random 64-bit number
+ */
+static inline uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Draw a request size, mostly small with a long tail
+ *
+ * @param state The random stream
+ * @param max The largest size to return
+ * @return A size between 1 and max
+ */
+static size_t random_size(uint64_t *state, size_t max) {
+    uint64_t x = next_random(state);
+    size_t limit = (x & 7) < 6 ? 256 : max;
+    return (size_t)((x >> 8) % (limit < max ? limit : max)) + 1;
+}
+
+/**
+ * Map a latency to its histogram bucket
+ *
+ * @param ns The latency
+ * @return The bucket index
+ */
+static unsigned bucket_of(uint64_t ns) {
+    if (ns < HIST_LINEAR) {
+        return (unsigned)ns;
+    }
+    unsigned order = 63 - __builtin_clzll(ns);
+    unsigned sub = (unsigned)(ns >> (order - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return HIST_LINEAR + (order - 6) * (1 << HIST_SUB_BITS) + sub;
+}
+
+/**
+ * Get the lower bound of a histogram bucket
+ *
+ * @param bucket The bucket index
+ * @return The smallest latency in the bucket, in ns
+ */
+static uint64_t bucket_floor(unsigned bucket) {
+    if (bucket < HIST_LINEAR) {
+        return bucket;
+    }
+    unsigned order = (bucket - HIST_LINEAR) / (1 << HIST_SUB_BITS) + 6;
+    unsigned sub = (bucket - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+    return (1ULL << order) + ((uint64_t)sub << (order - HIST_SUB_BITS));
+}
+
+/**
+ * Find a percentile in a histogram
+ *
+ * @param h The histogram
+ * @param fraction The percentile as a fraction, like 0.99
+ * @return The latency at that percentile, in ns
+ */
+static uint64_t percentile(const histogram *h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)h->total);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            return bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Time one allocation
+ *
+ * @param w The calling worker
+ * @param size The size to allocate
+ * @return The allocated memory, with its first byte written
+ */
+static void *timed_malloc(worker *w, size_t size) {
+    uint64_t start = now_ns();
+    char *ptr = w->r->alloc->malloc(size);
+    w->hist.counts[bucket_of(now_ns() - start)]++;
+    w->hist.total++;
+    if (ptr == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+    ptr[0] = (char)size;
+    return ptr;
+}
+
+/**
+ * Time one free
+ *
+ * @param w The calling worker
+ * @param ptr The memory to free
+ */
+static void timed_free(worker *w, void *ptr) {
+    uint64_t start = now_ns();
+    w->r->alloc->free(ptr);
+    w->hist.counts[bucket_of(now_ns() - start)]++;
+    w->hist.total++;
+}
+
+/**
+ * Time one reallocation
+ *
+ * @param w The calling worker
+ * @param ptr The memory to resize
+ * @param size The new size
+ * @return The resized memory, with its last byte written
+ */
+static void *timed_realloc(worker *w, void *ptr, size_t size) {
+    uint64_t start = now_ns();
+    char *moved = w->r->alloc->realloc(ptr, size);
+    w->hist.counts[bucket_of(now_ns() - start)]++;
+    w->hist.total++;
+    if (moved == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+    moved[size - 1] = (char)size;
+    return moved;
+}
+
+/**
+ * Record how much a worker holds, for the fragmentation ratio
+ *
+ * Called by every worker just before it exits, with what it still holds.
+ * The resident size is read once all workers have exited.
+ *
+ * @param w The calling worker
+ * @param bytes The bytes the worker holds
+ */
+static void hold_point(worker *w, uint64_t bytes) {
+    pthread_mutex_lock(&w->r->lock);
+    w->r->live_bytes += bytes;
+    pthread_mutex_unlock(&w->r->lock);
+}
+
+/* Random-size churn: every thread replaces random slots of its own table */
+
+#define CHURN_SLOTS 8192 /**< Live objects per churn thread */
+
+/**
+ * Body of a churn worker
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *churn_thread(void *arg) {
+    worker *w = arg;
+    void **slots = calloc(CHURN_SLOTS, sizeof(void *));
+    size_t *sizes = calloc(CHURN_SLOTS, sizeof(size_t));
+    uint64_t live = 0;
+
+    for (uint64_t i = 0; i < w->r->ops; i++) {
+        size_t slot = next_random(&w->rng) % CHURN_SLOTS;
+        if (slots[slot] != NULL) {
+            timed_free(w, slots[slot]);
+            live -= sizes[slot];
+            slots[slot] = NULL;
+        } else {
+            sizes[slot] = random_size(&w->rng, 4096);
+            slots[slot] = timed_malloc(w, sizes[slot]);
+            live += sizes[slot];
+        }
+    }
+
+    w->arg = slots;
+    hold_point(w, live);
+    free(sizes);
+    return NULL;
+}
+
+/**
+ * Free the tables the churn workers left behind
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void slots_teardown(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t++) {
+        void **slots = workers[t].arg;
+        for (size_t i = 0; i < CHURN_SLOTS; i++) {
+            if (slots[i] != NULL) {
+                r->alloc->free(slots[i]);
+            }
+        }
+        free(slots);
+    }
+}
+
+/* Larson server simulation: tables move to fresh threads every round */
+
+#define LARSON_ROUNDS 8 /**< Generations of threads in the Larson workload */
+
+/**
+ * Body of a Larson worker, one round of one generation
+ *
+ * The table it works on was filled by a thread of the previous generation,
+ * so most frees hit memory another, now dead, thread allocated.
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *larson_thread(void *arg) {
+    worker *w = arg;
+    void **slots = w->arg;
+    size_t *sizes = (size_t *)(slots + CHURN_SLOTS);
+
+    for (uint64_t i = 0; i < w->r->ops / LARSON_ROUNDS; i++) {
+        size_t slot = next_random(&w->rng) % CHURN_SLOTS;
+        if (slots[slot] != NULL) {
+            timed_free(w, slots[slot]);
+        }
+        sizes[slot] = random_size(&w->rng, 512);
+        slots[slot] = timed_malloc(w, sizes[slot]);
+    }
+    return NULL;
+}
+
+/**
+ * Record the working set the Larson generations left behind and free it
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void larson_teardown(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t++) {
+        void **slots = workers[t].arg;
+        size_t *sizes = (size_t *)(slots + CHURN_SLOTS);
+        for (size_t i = 0; i < CHURN_SLOTS; i++) {
+            r->live_bytes += slots[i] != NULL ? sizes[i] : 0;
+        }
+    }
+    r->rss_at_live = current_rss();
+    slots_teardown(r, workers);
+}
+
+/**
+ * Give every Larson worker its table
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void larson_setup(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t++) {
+        workers[t].arg = calloc(CHURN_SLOTS, sizeof(void *) + sizeof(size_t));
+    }
+}
+
+/* Producer/consumer: objects are freed by a different thread than their allocator */
+
+#define RING_SIZE 1024 /**< Slots in a producer/consumer ring */
+
+/**
+ * Single producer, single consumer ring of pointers
+ */
+typedef struct ring {
+    void *slots[RING_SIZE]; /**< The pointers in flight */
+    uint64_t head; /**< Next slot the producer writes */
+    uint64_t tail; /**< Next slot the consumer reads */
+    uint64_t count; /**< Pointers the producer will send */
+} ring;
+
+/**
+ * Body of a producer or consumer
+ *
+ * Even workers produce into the ring shared with the next odd worker,
+ * which frees everything it receives. Waiting threads yield, so the
+ * workload also runs on a single CPU.
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *prodcons_thread(void *arg) {
+    worker *w = arg;
+    ring *q = w->arg;
+
+    for (uint64_t i = 0; i < q->count; i++) {
+        if (w->id % 2 == 0) {
+            void *ptr = timed_malloc(w, random_size(&w->rng, 1024));
+            while (i - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+                sched_yield();
+            }
+            q->slots[i % RING_SIZE] = ptr;
+            __atomic_store_n(&q->head, i + 1, __ATOMIC_RELEASE);
+        } else {
+            while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) <= i) {
+                sched_yield();
+            }
+            void *ptr = q->slots[i % RING_SIZE];
+            __atomic_store_n(&q->tail, i + 1, __ATOMIC_RELEASE);
+            timed_free(w, ptr);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Give every producer/consumer pair its ring
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void prodcons_setup(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t += 2) {
+        ring *q = calloc(1, sizeof(ring));
+        q->count = r->ops;
+        workers[t].arg = q;
+        if (t + 1 < r->threads) {
+            workers[t + 1].arg = q;
+        } else {
+            // An odd one out would produce forever, give it nothing to do
+            q->count = 0;
+        }
+    }
+}
+
+/**
+ * Free the rings
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void prodcons_teardown(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t += 2) {
+        free(workers[t].arg);
+    }
+}
+
+/* Realloc growth: buffers grow by small appends, like string builders */
+
+#define GROW_BUFFERS 64 /**< Buffers each realloc worker keeps growing */
+#define GROW_LIMIT (256 * 1024) /**< A buffer starts over once it reaches this size */
+
+/**
+ * Body of a realloc worker
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *grow_thread(void *arg) {
+    worker *w = arg;
+    void **buffers = calloc(GROW_BUFFERS, sizeof(void *));
+    size_t *sizes = calloc(GROW_BUFFERS, sizeof(size_t));
+    uint64_t live = 0;
+
+    for (uint64_t i = 0; i < w->r->ops; i++) {
+        size_t b = next_random(&w->rng) % GROW_BUFFERS;
+        if (sizes[b] >= GROW_LIMIT) {
+            timed_free(w, buffers[b]);
+            live -= sizes[b];
+            buffers[b] = NULL;
+            sizes[b] = 0;
+            continue;
+        }
+
+        size_t grown = sizes[b] + 1 + next_random(&w->rng) % 256;
+        buffers[b] = timed_realloc(w, buffers[b], grown);
+        live += grown - sizes[b];
+        sizes[b] = grown;
+    }
+
+    hold_point(w, live);
+    w->arg = buffers;
+    free(sizes);
+    return NULL;
+}
+
+/**
+ * Free the buffers the realloc workers left behind
+ *
+ * @param r The run
+ * @param workers The workers
+ */
+static void grow_teardown(run *r, worker *workers) {
+    for (unsigned t = 0; t < r->threads; t++) {
+        void **buffers = workers[t].arg;
+        for (size_t i = 0; i < GROW_BUFFERS; i++) {
+            r->alloc->free(buffers[i]);
+        }
+        free(buffers);
+    }
+}
+
+/* Small-object storm: bursts of tiny list nodes, allocated and freed in bulk */
+
+#define STORM_BURST 100000 /**< Objects per burst */
+
+/**
+ * Body of a storm worker
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *storm_thread(void *arg) {
+    worker *w = arg;
+    void **objects = malloc(STORM_BURST * sizeof(void *));
+    uint64_t bursts = w->r->ops / (2 * STORM_BURST);
+
+    for (uint64_t b = 0; b < (bursts > 0 ? bursts : 1); b++) {
+        uint64_t live = 0;
+        for (size_t i = 0; i < STORM_BURST; i++) {
+            size_t size = 16 + (next_random(&w->rng) % 4) * 16;
+            objects[i] = timed_malloc(w, size);
+            live += size;
+        }
+        if (b + 1 == (bursts > 0 ? bursts : 1)) {
+            // Everything is freed below, so read the resident size at the peak
+            size_t rss = current_rss();
+            pthread_mutex_lock(&w->r->lock);
+            if (rss > w->r->rss_at_live) {
+                w->r->rss_at_live = rss;
+            }
+            pthread_mutex_unlock(&w->r->lock);
+            hold_point(w, live);
+        }
+        for (size_t i = 0; i < STORM_BURST; i++) {
+            timed_free(w, objects[i]);
+        }
+    }
+
+    free(objects);
+    return NULL;
+}
+
+static const workload WORKLOADS[] = {
+    {"churn", 1, NULL, churn_thread, slots_teardown},
+    {"larson", LARSON_ROUNDS, larson_setup, larson_thread, larson_teardown},
+    {"prodcons", 1, prodcons_setup, prodcons_thread, prodcons_teardown},
+    {"realloc", 1, NULL, grow_thread, grow_teardown},
+    {"storm", 1, NULL, storm_thread, NULL},
+};
+
+/**
+ * Run one workload against one allocator and print its results
+ *
+ * Runs in a child process of its own, so allocators and workloads never
+ * see each other's heap and the peak RSS belongs to this run alone.
+ *
+ * @param wl The workload
+ * @param r The run settings
+ */
+static void run_workload(const workload *wl, run *r) {
+    worker workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    size_t rss_before = current_rss();
+
+    memset(workers, 0, sizeof(workers));
+    for (unsigned t = 0; t < r->threads; t++) {
+        workers[t].r = r;
+        workers[t].id = t;
+        workers[t].rng = r->seed * 0x9E3779B97F4A7C15ULL + t + 1;
+    }
+    if (wl->setup != NULL) {
+        wl->setup(r, workers);
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned round = 0; round < wl->rounds; round++) {
+        for (unsigned t = 0; t < r->threads; t++) {
+            pthread_create(&threads[t], NULL, wl->thread, &workers[t]);
+        }
+        for (unsigned t = 0; t < r->threads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    if (r->live_bytes > 0 && r->rss_at_live == 0) {
+        r->rss_at_live = current_rss();
+    }
+    if (wl->teardown != NULL) {
+        wl->teardown(r, workers);
+    }
+
+    for (unsigned t = 0; t < r->threads; t++) {
+        for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+            r->hist.counts[i] += workers[t].hist.counts[i];
+        }
+        r->hist.total += workers[t].hist.total;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = (size_t)usage.ru_maxrss * 1024;
+
+    printf("{\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %u, \"calls\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"peak_rss_kb\": %zu, ",
+           wl->name, r->alloc->name, r->threads, (unsigned long long)r->hist.total, seconds,
+           (double)r->hist.total / seconds, (unsigned long long)percentile(&r->hist, 0.50),
+           (unsigned long long)percentile(&r->hist, 0.99), (unsigned long long)percentile(&r->hist, 0.999),
+           (peak_rss - (peak_rss > rss_before ? rss_before : peak_rss)) / 1024);
+    if (r->live_bytes > 0) {
+        printf("\"fragmentation\": %.3f}\n",
+               (double)(r->rss_at_live > rss_before ? r->rss_at_live - rss_before : 0) / (double)r->live_bytes);
+    } else {
+        printf("\"fragmentation\": null}\n");
+    }
+    fflush(stdout);
+}
+
+/**
+ * Print the command line help
+ *
+ * @param name The name of the program
+ */
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n calls] [-s seed] [-w workload] [-a allocator]\n"
+            "  workloads: churn larson prodcons realloc storm (default: all)\n"
+            "  allocators: tumalloc glibc (default: both)\n"
+            "Prints one JSON object per workload and allocator.\n",
+            name);
+}
+
+/**
+ * Run the benchmarks
+ *
+ * Every workload runs against every allocator in a forked child, one
+ * after the other, with the same seed, so runs are reproducible.
+ *
+ * @param argc Number of arguments
+ * @param argv The arguments
+ * @return 0 on success
+ */
+int main(int argc, char **argv) {
+    unsigned threads = 4;
+    uint64_t ops = 1000000;
+    uint64_t seed = 1;
+    const char *only_workload = NULL;
+    const char *only_allocator = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:s:w:a:h")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            only_workload = optarg;
+            break;
+        case 'a':
+            only_allocator = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || ops < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (size_t wi = 0; wi < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]); wi++) {
+        if (only_workload != NULL && strcmp(only_workload, WORKLOADS[wi].name) != 0) {
+            continue;
+        }
+        for (size_t ai = 0; ai < sizeof(ALLOCATORS) / sizeof(ALLOCATORS[0]); ai++) {
+            if (only_allocator != NULL && strcmp(only_allocator, ALLOCATORS[ai].name) != 0) {
+                continue;
+            }
+
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                static run r;
+                r.alloc = &ALLOCATORS[ai];
+                r.threads = threads;
+                r.ops = ops;
+                r.seed = seed;
+                pthread_mutex_init(&r.lock, NULL);
+                run_workload(&WORKLOADS[wi], &r);
+                _exit(0);
+            }
+
+            int status;
+            if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "bench: %s/%s failed\n", WORKLOADS[wi].name, ALLOCATORS[ai].name);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
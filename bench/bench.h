@@ -0,0 +1,60 @@
+#ifndef CYB3053_PROJECT2_BENCH_H
+#define CYB3053_PROJECT2_BENCH_H
+
+#include "alloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Helpers shared by bench and tureplay
+
+/**
+ * The functions of one allocator under test
+ */
+typedef struct allocator {
+    const char *name; /**< Name used on the command line and in the results */
+    void *(*malloc)(size_t size); /**< Allocate */
+    void *(*calloc)(size_t num, size_t size); /**< Allocate zeroed */
+    void *(*realloc)(void *ptr, size_t size); /**< Resize */
+    void *(*aligned_alloc)(size_t alignment, size_t size); /**< Allocate aligned */
+    void (*free)(void *ptr); /**< Free */
+} allocator;
+
+static const allocator ALLOCATORS[] = {
+    {"tumalloc", tumalloc, tucalloc, turealloc, tualigned_alloc, tufree},
+    {"glibc", malloc, calloc, realloc, aligned_alloc, free},
+};
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Read the resident set size of the process
+ *
+ * @return The resident bytes
+ */
+static inline size_t current_rss(void) {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+#endif //CYB3053_PROJECT2_BENCH_H
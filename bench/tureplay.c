@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * A block the replay holds, under the id the trace gave it
+ */
+typedef struct live_block {
+    uint64_t id; /**< Pointer in the trace, zero for an empty slot */
+    char *ptr; /**< Pointer in the replay */
+    size_t size; /**< Requested bytes */
+} live_block;
+
+/**
+ * Open addressing table from trace ids to replayed blocks
+ *
+ * The same id can be live more than once for a moment, when one thread's
+ * free of an address was recorded after another thread got it back. Linear
+ * probing keeps such entries in insertion order, so lookups find the oldest.
+ */
+typedef struct block_table {
+    live_block *slots; /**< The slots, a power of two of them */
+    size_t mask; /**< Number of slots minus one */
+} block_table;
+
+/**
+ * Order of replay, by time and then by position in the file
+ */
+typedef struct replay_step {
+    uint64_t time; /**< Time of the record */
+    uint64_t index; /**< Position of the record in the file */
+} replay_step;
+
+/**
+ * Compare two replay steps for qsort
+ *
+ * @param a The first step
+ * @param b The second step
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int step_compare(const void *a, const void *b) {
+    const replay_step *x = a;
+    const replay_step *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Get the first slot an id probes
+ *
+ * @param t The table
+ * @param id The id
+ * @return The slot index
+ */
+static size_t table_home(const block_table *t, uint64_t id) {
+    return (size_t)((id >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & t->mask;
+}
+
+/**
+ * Add a block to the table, behind any live block with the same id
+ *
+ * @param t The table, never full
+ * @param id The trace id
+ * @param ptr The replayed block
+ * @param size The requested bytes
+ */
+static void table_insert(block_table *t, uint64_t id, char *ptr, size_t size) {
+    size_t i = table_home(t, id);
+    while (t->slots[i].id != 0) {
+        i = (i + 1) & t->mask;
+    }
+    t->slots[i].id = id;
+    t->slots[i].ptr = ptr;
+    t->slots[i].size = size;
+}
+
+/**
+ * Find the oldest live block with an id
+ *
+ * @param t The table
+ * @param id The trace id
+ * @return The slot index, or SIZE_MAX if the id is not live
+ */
+static size_t table_find(const block_table *t, uint64_t id) {
+    for (size_t i = table_home(t, id); t->slots[i].id != 0; i = (i + 1) & t->mask) {
+        if (t->slots[i].id == id) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * Empty a slot, shifting later entries back so no probe chain breaks
+ *
+ * @param t The table
+ * @param i The slot to empty
+ */
+static void table_remove(block_table *t, size_t i) {
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].id == 0) {
+            break;
+        }
+        // An entry whose home lies cyclically in (i, j] must stay put
+        size_t k = table_home(t, t->slots[j].id);
+        if (j > i ? (k <= i || k > j) : (k <= i && k > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].id = 0;
+}
+
+/**
+ * Write one byte per page of a block, like a program filling it would
+ *
+ * @param ptr The block
+ * @param from The first byte not touched yet
+ * @param size The size of the block
+ */
+static void touch(char *ptr, size_t from, size_t size) {
+    for (size_t i = from; i < size; i += 4096) {
+        ptr[i] = (char)i;
+    }
+    if (size > from) {
+        ptr[size - 1] = 1;
+    }
+}
+
+/**
+ * Replay a trace against one allocator and print the results
+ *
+ * Every record is replayed from one thread, in time order, so the same
+ * trace always makes the same calls in the same order. Frees of blocks the
+ * trace never saw allocated, for instance from before recording started,
+ * are skipped.
+ *
+ * @param path The trace file, for the report
+ * @param records The records of the trace
+ * @param count How many records there are
+ * @param alloc The allocator to replay against
+ * @return 0 on success, 1 when out of memory
+ */
+static int replay(const char *path, const trace_record *records, size_t count, const allocator *alloc) {
+    replay_step *steps = malloc(count * sizeof(replay_step));
+    block_table table;
+    size_t slots = 1024;
+    while (slots < 2 * count) {
+        slots *= 2;
+    }
+    table.slots = calloc(slots, sizeof(live_block));
+    table.mask = slots - 1;
+    if (steps == NULL || table.slots == NULL) {
+        fprintf(stderr, "tureplay: out of memory\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        steps[i].time = records[i].time;
+        steps[i].index = i;
+    }
+    qsort(steps, count, sizeof(replay_step), step_compare);
+    // Fault the table in now, so its pages are not charged to the allocator
+    memset(table.slots, 0, slots * sizeof(live_block));
+
+    size_t rss_before = current_rss();
+    uint64_t live = 0;
+    uint64_t peak_live = 0;
+    uint64_t skipped = 0;
+
+    uint64_t start = now_ns();
+    for (size_t s = 0; s < count; s++) {
+        const trace_record *r = &records[steps[s].index];
+        char *ptr = NULL;
+        size_t old_size = 0;
+
+        switch (r->op) {
+        case TRACE_MALLOC:
+            ptr = alloc->malloc(r->size);
+            break;
+        case TRACE_CALLOC:
+            ptr = alloc->calloc(1, r->size);
+            break;
+        case TRACE_ALIGNED:
+            ptr = alloc->aligned_alloc(r->arg, r->size);
+            break;
+        case TRACE_REALLOC: {
+            size_t i = r->arg != 0 ? table_find(&table, r->arg) : SIZE_MAX;
+            if (i != SIZE_MAX) {
+                ptr = table.slots[i].ptr;
+                old_size = table.slots[i].size;
+                live -= old_size;
+                table_remove(&table, i);
+            }
+            ptr = alloc->realloc(ptr, r->size);
+            break;
+        }
+        case TRACE_FREE: {
+            size_t i = table_find(&table, r->ptr);
+            if (i == SIZE_MAX) {
+                skipped++;
+                continue;
+            }
+            alloc->free(table.slots[i].ptr);
+            live -= table.slots[i].size;
+            table_remove(&table, i);
+            continue;
+        }
+        default:
+            skipped++;
+            continue;
+        }
+
+        if (ptr == NULL) {
+            fprintf(stderr, "tureplay: out of memory at record %llu\n", (unsigned long long)steps[s].index);
+            return 1;
+        }
+        touch(ptr, old_size, r->size);
+        table_insert(&table, r->ptr, ptr, r->size);
+        live += r->size;
+        if (live > peak_live) {
+            peak_live = live;
+        }
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = (size_t)usage.ru_maxrss * 1024;
+    size_t used_rss = peak_rss > rss_before ? peak_rss - rss_before : 0;
+
+    printf("{\"trace\": \"%s\", \"allocator\": \"%s\", \"records\": %zu, \"skipped\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"peak_live_kb\": %llu, \"peak_rss_kb\": %zu, ",
+           path, alloc->name, count, (unsigned long long)skipped, seconds, (double)(count - skipped) / seconds,
+           (unsigned long long)(peak_live / 1024), used_rss / 1024);
+    if (peak_live > 0) {
+        printf("\"fragmentation\": %.3f}\n", (double)used_rss / (double)peak_live);
+    } else {
+        printf("\"fragmentation\": null}\n");
+    }
+    fflush(stdout);
+
+    for (size_t i = 0; i <= table.mask; i++) {
+        if (table.slots[i].id != 0) {
+            alloc->free(table.slots[i].ptr);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replay a recorded trace against this allocator and the C library's
+ *
+ * Record a trace by running any program with TUMALLOC_TRACE=<file>, either
+ * linked against the allocator or under LD_PRELOAD=libtumalloc.so. Each
+ * allocator replays in a forked child of its own, so peak RSS is its own.
+ *
+ * @param argc Number of arguments
+ * @param argv The arguments
+ * @return 0 on success
+ */
+int main(int argc, char **argv) {
+    const char *only_allocator = NULL;
+
+    // Replaying must not record a trace of its own
+    unsetenv("TUMALLOC_TRACE");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:h")) != -1) {
+        if (opt == 'a') {
+            only_allocator = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-a tumalloc|glibc] trace\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-a tumalloc|glibc] trace\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 1;
+    }
+    const trace_header *header = NULL;
+    if ((size_t)st.st_size >= sizeof(trace_header)) {
+        header = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (header == NULL || header == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || header->version != TRACE_VERSION || header->record_size != sizeof(trace_record)) {
+        fprintf(stderr, "%s: not a trace of this version\n", path);
+        return 1;
+    }
+    const trace_record *records = (const trace_record *)(header + 1);
+    size_t count = ((size_t)st.st_size - sizeof(trace_header)) / sizeof(trace_record);
+
+    for (size_t ai = 0; ai < sizeof(ALLOCATORS) / sizeof(ALLOCATORS[0]); ai++) {
+        if (only_allocator != NULL && strcmp(only_allocator, ALLOCATORS[ai].name) != 0) {
+            continue;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(replay(path, records, count, &ALLOCATORS[ai]));
+        }
+
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "tureplay: replay against %s failed\n", ALLOCATORS[ai].name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -1,370 +1,2731 @@
-#include "alloc.h"
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+#include "trace.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
-#define ALIGNMENT 16 /**< The alignment of the memory blocks */
 #define MAGIC_NUMBER 0x01234567 /**< Magic number for error checking */
 #define FREED_MAGIC 0xCAFEBABE /**< Magic number for freed blocks */
+#define REMOTE_MAGIC 0x7E307E0F /**< Magic number for blocks on an arena's remote list */
 
-static free_block *HEAD = NULL; /**< Pointer to the first element of the free list */
-static free_block *LAST_ALLOCATION_POINT = NULL; /**< Pointer to the block after the last allocated block for Next Fit */
+#define BLOCK_PREV_FREE 0x1 /**< The previous block is free and its footer is valid */
+#define BLOCK_FENCE 0x2 /**< Zero sized block marking the end of a heap segment */
+#define BLOCK_MMAPPED 0x4 /**< Block has its own mapping and goes back with munmap */
+
+#define MIN_BLOCK_SIZE 32 /**< Smallest payload that fits the free list links and a footer */
+
+#define ARENAS_PER_CPU 4 /**< Default number of arenas per online CPU */
+
+#define HEAP_GROW_MIN (1 << 20) /**< First growth step of an arena, and how much a trim keeps */
+#define DEFAULT_GROW_MAX (4 << 20) /**< Default largest growth step, reached by doubling on every growth */
+#define DEFAULT_TRIM_THRESHOLD DEFAULT_GROW_MAX /**< Top chunk size that triggers a trim */
+
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024) /**< Requests from this size up get their own mapping */
+
+#define DEFAULT_DECAY_MS 10000 /**< How long free pages stay dirty before they are purged */
+#define DECAY_TICKS 4 /**< Purge ticks per decay time */
+
+static size_t MMAP_THRESHOLD = DEFAULT_MMAP_THRESHOLD; /**< Set at startup from TUMALLOC_MMAP_THRESHOLD, or by tumallctl */
+static size_t TRIM_THRESHOLD = DEFAULT_TRIM_THRESHOLD; /**< Set at startup from TUMALLOC_TRIM_THRESHOLD, or by tumallctl */
+static size_t GROW_MAX = DEFAULT_GROW_MAX; /**< Largest growth step of an arena, set at startup or by tumallctl */
+static uint64_t PURGE_INTERVAL = DEFAULT_DECAY_MS * 1000000ULL / DECAY_TICKS; /**< Nanoseconds per purge tick, zero when purging is off */
+static int FIT_POLICY = TUMALLOC_FIT_BEST; /**< How the free trees pick a block, from TUMALLOC_FIT or tumalloc_set_fit */
+static int STATS_PRINT = 0; /**< Write a report to stderr at exit, from TUMALLOC_CONF or tumallctl */
+size_t PAGE_SIZE = 4096; /**< Page size of the system, set once at startup */
+int HUGE_PAGES = 0; /**< Set once at startup from TUMALLOC_HUGEPAGES */
+static size_t PURGE_PAGE = 4096; /**< Granularity of purging and trimming, a huge page when HUGE_PAGES is set */
+
+arena ARENAS[MAX_ARENAS]; /**< All arenas, the first NUM_ARENAS are in use */
+unsigned NUM_ARENAS = 1; /**< Number of arenas, set once at startup */
+static unsigned NEXT_ARENA = 0; /**< Round-robin counter for assigning threads to arenas */
+static pthread_once_t INIT_ONCE = PTHREAD_ONCE_INIT; /**< Guards tumalloc_init */
+
+static __thread arena *THREAD_ARENA = NULL; /**< The arena the calling thread allocates from */
+static __thread arena *THREAD_ARENA_OLD = NULL; /**< The arena the calling thread last moved away from */
 
 /**
- * Split a free block into two blocks
+ * The part of a new heap block that is known to read as zeros
  *
- * @param block The block to split
- * @param size The size of the first new split block
- * @return A pointer to the first block or NULL if the block cannot be split
+ * Memory the top chunk never wrote and pages purged out of a free block
+ * come back zeroed from the OS. The range is empty when start >= end.
  */
-void *split(free_block *block, int size) {
-    if((block->size < size + sizeof(free_block))) {
-        return NULL;
-    }
+typedef struct zero_range {
+    char *start; /**< First byte known to be zero */
+    char *end; /**< First byte after them */
+} zero_range;
 
-    void *split_pnt = (char *)block + size + sizeof(free_block);
-    free_block *new_block = (free_block *) split_pnt;
+#define DEFAULT_TCACHE_MAX 64 /**< Default for TCACHE_MAX */
+#define TCACHE_BATCH 16 /**< Blocks moved between a thread cache and the heap at once */
 
-    new_block->size = block->size - size - sizeof(free_block);
-    new_block->next = block->next;
+static unsigned TCACHE_MAX = DEFAULT_TCACHE_MAX; /**< Blocks a thread caches per size class before flushing, set once at startup */
+#define TCACHE_CANARY ((uintptr_t)0x7CAC4E017CAC4E01ULL) /**< Marks the second word of a cached block */
+#define REMOTE_DRAIN_MIN 1024 /**< Remote blocks after which the pusher drains an idle arena itself */
+#define REMOTE_DRAIN_BYTES (4UL << 20) /**< Remote bytes after which the pusher drains an idle arena itself */
 
-    block->size = size;
+/**
+ * Per-thread cache of small slab objects
+ *
+ * Cached objects stay allocated as far as their slabs are concerned, so the
+ * fast paths of tumalloc and tufree only touch thread-local state. The second
+ * word of a cached object holds TCACHE_CANARY to catch double frees.
+ */
+typedef struct tcache {
+    void *entries[SMALL_CLASS_COUNT]; /**< Cached objects per class, linked through their first word */
+    uint32_t space[SMALL_CLASS_COUNT]; /**< Free slots left in each list, zero until registered */
+    int state; /**< TCACHE_UNREGISTERED, TCACHE_ACTIVE or TCACHE_SHUTDOWN */
+} tcache;
 
-    return block;
-}
+#define TCACHE_UNREGISTERED 0 /**< The exit handler of the thread is not installed yet */
+#define TCACHE_ACTIVE 1 /**< The cache is in use */
+#define TCACHE_SHUTDOWN 2 /**< The thread is exiting and the cache was drained */
+
+static __thread tcache TCACHE; /**< The cache of the calling thread */
+static pthread_key_t TCACHE_KEY; /**< Key whose destructor drains a thread's cache */
+
+static void tcache_shutdown(void *arg);
 
 /**
- * Find the previous neighbor of a block
+ * Read a numeric setting from the environment
  *
- * @param block The block to find the previous neighbor of
- * @return A pointer to the previous neighbor or NULL if there is none
+ * @param name The name of the environment variable
+ * @param fallback The value to use when the variable is not set
+ * @return The value of the variable or fallback
  */
-free_block *find_prev(free_block *block) {
-    free_block *curr = HEAD;
-    while(curr != NULL) {
-        char *next = (char *)curr + curr->size + sizeof(free_block);
-        if(next == (char *)block)
-            return curr;
-        curr = curr->next;
+static unsigned long env_number(const char *name, unsigned long fallback) {
+    const char *env = getenv(name);
+    if (env == NULL || *env == '\0') {
+        return fallback;
     }
-    return NULL;
+    return strtoul(env, NULL, 10);
 }
 
 /**
- * Find the next neighbor of a block
+ * Report a corrupted heap or a bad pointer and stop
  *
- * @param block The block to find the next neighbor of
- * @return A pointer to the next neighbor or NULL if there is none
+ * Writes straight to the file descriptor, since stdio may allocate and we
+ * could be serving malloc for the whole process.
  */
-free_block *find_next(free_block *block) {
-    char *block_end = (char*)block + block->size + sizeof(free_block);
-    free_block *curr = HEAD;
+void corruption_detected(void) {
+    static const char message[] = "MEMORY CORRUPTION DETECTED\n";
+    ssize_t written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+    (void)written;
+    abort();
+}
 
-    while(curr != NULL) {
-        if((char *)curr == block_end)
-            return curr;
-        curr = curr->next;
+/**
+ * Hold every allocator lock across fork
+ *
+ * The arenas are always locked in index order, and the slab region lock is
+ * only taken inside an arena lock. The stats lock is taken last, because
+ * readers lock arenas one at a time while holding it. The profile lock is
+ * never held together with another one.
+ */
+static void fork_prepare(void) {
+    for (unsigned i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_lock(&ARENAS[i].lock);
     }
-    return NULL;
+    slab_fork_lock();
+    stats_fork_lock();
+    prof_fork_lock();
 }
 
 /**
- * Remove a block from the free list
+ * Release the locks taken by fork_prepare, in the parent and in the child
  *
- * @param block The block to remove
+ * The child only has the thread that forked, which is the one holding the
+ * locks, so it can simply unlock them.
  */
-void remove_free_block(free_block *block) {
-    // Update the LAST_ALLOCATION_POINT if needed
-    if (LAST_ALLOCATION_POINT == block) {
-        LAST_ALLOCATION_POINT = block->next;
+static void fork_release(void) {
+    prof_fork_unlock();
+    stats_fork_unlock();
+    slab_fork_unlock();
+    for (unsigned i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_unlock(&ARENAS[i].lock);
     }
+}
 
-    free_block *curr = HEAD;
-    if(curr == block) {
-        HEAD = block->next;
-        return;
+/**
+ * Release the locks taken by fork_prepare in the child, and stop tracing there
+ */
+static void fork_child(void) {
+    trace_fork_child();
+    fork_release();
+}
+
+/**
+ * Settings of TUMALLOC_CONF and tumallctl
+ */
+enum {
+    OPT_ARENAS, /**< Number of arenas */
+    OPT_FIT, /**< Fit policy, one of TUMALLOC_FIT_ */
+    OPT_MMAP_THRESHOLD, /**< Size from which blocks get their own mapping */
+    OPT_TRIM_THRESHOLD, /**< Top chunk size that gets trimmed */
+    OPT_HEAP_GROW, /**< Largest growth step of an arena heap */
+    OPT_TCACHE_MAX, /**< Objects a thread caches per small size class */
+    OPT_DECAY_MS, /**< Milliseconds free pages stay dirty, zero turns purging off */
+    OPT_HUGEPAGES, /**< Back heaps and slabs with transparent huge pages */
+    OPT_PROFILE, /**< Mean bytes between heap profile samples, zero for none */
+    OPT_STATS_PRINT, /**< Write a report to stderr at exit */
+    OPT_COUNT
+};
+
+/**
+ * Name of a setting, and whether it may change once the allocator runs
+ */
+static const struct {
+    const char *name; /**< Name in TUMALLOC_CONF and tumallctl */
+    int runtime; /**< Non-zero if tumallctl may change it */
+} OPTIONS[OPT_COUNT] = {
+    [OPT_ARENAS] = {"arenas", 0},
+    [OPT_FIT] = {"fit", 1},
+    [OPT_MMAP_THRESHOLD] = {"mmap_threshold", 1},
+    [OPT_TRIM_THRESHOLD] = {"trim_threshold", 1},
+    [OPT_HEAP_GROW] = {"heap_grow", 1},
+    [OPT_TCACHE_MAX] = {"tcache_max", 0},
+    [OPT_DECAY_MS] = {"decay_ms", 1},
+    [OPT_HUGEPAGES] = {"hugepages", 0},
+    [OPT_PROFILE] = {"profile", 0},
+    [OPT_STATS_PRINT] = {"stats_print", 1},
+};
+
+static uint64_t PROFILE_RATE = 0; /**< Sample rate handed to prof_init */
+static char PROFILE_FILE[256]; /**< prof_file from TUMALLOC_CONF, empty when not given */
+
+/**
+ * Look up a setting by name
+ *
+ * @param name The name, not necessarily terminated
+ * @param length The length of the name
+ * @return The setting, or -1 if there is none by that name
+ */
+static int option_find(const char *name, size_t length) {
+    for (int id = 0; id < OPT_COUNT; id++) {
+        if (strlen(OPTIONS[id].name) == length && memcmp(OPTIONS[id].name, name, length) == 0) {
+            return id;
+        }
     }
-    while(curr != NULL) {
-        if(curr->next == block) {
-            curr->next = block->next;
-            return;
+    return -1;
+}
+
+/**
+ * Read a setting
+ *
+ * @param id The setting
+ * @return Its current value
+ */
+static size_t option_get(int id) {
+    switch (id) {
+    case OPT_ARENAS:
+        return NUM_ARENAS;
+    case OPT_FIT:
+        return (size_t)__atomic_load_n(&FIT_POLICY, __ATOMIC_RELAXED);
+    case OPT_MMAP_THRESHOLD:
+        return __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED);
+    case OPT_TRIM_THRESHOLD:
+        return __atomic_load_n(&TRIM_THRESHOLD, __ATOMIC_RELAXED);
+    case OPT_HEAP_GROW:
+        return __atomic_load_n(&GROW_MAX, __ATOMIC_RELAXED);
+    case OPT_TCACHE_MAX:
+        return TCACHE_MAX;
+    case OPT_DECAY_MS:
+        return (size_t)(__atomic_load_n(&PURGE_INTERVAL, __ATOMIC_RELAXED) * DECAY_TICKS / 1000000ULL);
+    case OPT_HUGEPAGES:
+        return (size_t)HUGE_PAGES;
+    case OPT_PROFILE:
+        return (size_t)__atomic_load_n(&PROF_RATE, __ATOMIC_RELAXED);
+    case OPT_STATS_PRINT:
+        return (size_t)__atomic_load_n(&STATS_PRINT, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Change a setting
+ *
+ * Settings without the runtime flag are only changed here while the
+ * allocator starts up. The others are plain stores, which every thread
+ * picks up on its next allocation that reads them.
+ *
+ * @param id The setting
+ * @param value The new value
+ * @return 0 on success, EINVAL if the value is out of range
+ */
+static int option_set(int id, size_t value) {
+    switch (id) {
+    case OPT_ARENAS:
+        if (value < 1 || value > MAX_ARENAS) {
+            return EINVAL;
+        }
+        NUM_ARENAS = (unsigned)value;
+        return 0;
+    case OPT_FIT:
+        if (value != TUMALLOC_FIT_FIRST && value != TUMALLOC_FIT_NEXT && value != TUMALLOC_FIT_BEST) {
+            return EINVAL;
+        }
+        __atomic_store_n(&FIT_POLICY, (int)value, __ATOMIC_RELAXED);
+        return 0;
+    case OPT_MMAP_THRESHOLD:
+        // Small classes never get their own mapping, the threshold must lie above them
+        if (value <= SMALL_CLASS_MAX) {
+            return EINVAL;
+        }
+        __atomic_store_n(&MMAP_THRESHOLD, value, __ATOMIC_RELAXED);
+        return 0;
+    case OPT_TRIM_THRESHOLD:
+        // trim_top always keeps HEAP_GROW_MIN bytes of the top chunk
+        if (value < HEAP_GROW_MIN) {
+            return EINVAL;
+        }
+        __atomic_store_n(&TRIM_THRESHOLD, value, __ATOMIC_RELAXED);
+        return 0;
+    case OPT_HEAP_GROW:
+        if (value < HEAP_GROW_MIN) {
+            return EINVAL;
         }
-        curr = curr->next;
+        __atomic_store_n(&GROW_MAX, value, __ATOMIC_RELAXED);
+        return 0;
+    case OPT_TCACHE_MAX:
+        // A flush takes half the list, so it must hold at least two objects
+        if (value < 2 || value > UINT16_MAX) {
+            return EINVAL;
+        }
+        TCACHE_MAX = (unsigned)value;
+        return 0;
+    case OPT_DECAY_MS:
+        if (value > UINT64_MAX / 1000000ULL) {
+            return EINVAL;
+        }
+        __atomic_store_n(&PURGE_INTERVAL, value * 1000000ULL / DECAY_TICKS, __ATOMIC_RELAXED);
+        return 0;
+    case OPT_HUGEPAGES:
+        if (value > 1) {
+            return EINVAL;
+        }
+        HUGE_PAGES = (int)value;
+        return 0;
+    case OPT_PROFILE:
+        PROFILE_RATE = value;
+        return 0;
+    case OPT_STATS_PRINT:
+        if (value > 1) {
+            return EINVAL;
+        }
+        __atomic_store_n(&STATS_PRINT, (int)value, __ATOMIC_RELAXED);
+        return 0;
     }
+    return EINVAL;
 }
 
 /**
- * Coalesce neighboring free blocks
+ * Complain about an entry of TUMALLOC_CONF that is ignored
  *
- * @param block The block to coalesce
- * @return A pointer to the first block of the coalesced blocks
+ * @param entry The entry, not necessarily terminated
+ * @param length Its length
  */
-void *coalesce(free_block *block) {
-    if (block == NULL) {
-        return NULL;
+static void config_warn(const char *entry, size_t length) {
+    static const char prefix[] = "tumalloc: ignoring TUMALLOC_CONF entry '";
+    ssize_t written = write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+    written = write(STDERR_FILENO, entry, length);
+    written = write(STDERR_FILENO, "'\n", 2);
+    (void)written;
+}
+
+/**
+ * Apply a setting from an environment variable of its own
+ *
+ * The value goes through option_set, so it is held to the same range as in
+ * TUMALLOC_CONF. A value out of range is reported on stderr and the setting
+ * keeps what it had.
+ *
+ * @param name The name of the environment variable
+ * @param id The setting
+ */
+static void env_option(const char *name, int id) {
+    const char *env = getenv(name);
+    if (env == NULL || *env == '\0' || option_set(id, strtoul(env, NULL, 10)) == 0) {
+        return;
     }
 
-    free_block *prev = find_prev(block);
-    free_block *next = find_next(block);
+    static const char prefix[] = "tumalloc: ignoring ";
+    ssize_t written = write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+    written = write(STDERR_FILENO, name, strlen(name));
+    written = write(STDERR_FILENO, "=", 1);
+    written = write(STDERR_FILENO, env, strlen(env));
+    written = write(STDERR_FILENO, "\n", 1);
+    (void)written;
+}
 
-    // Coalesce with previous block if it is contiguous.
-    if (prev != NULL) {
-        char *end_of_prev = (char *)prev + prev->size + sizeof(free_block);
-        if (end_of_prev == (char *)block) {
-            // If LAST_ALLOCATION_POINT is block, update it to prev
-            if (LAST_ALLOCATION_POINT == block) {
-                LAST_ALLOCATION_POINT = prev;
-            }
+/**
+ * Apply the settings of TUMALLOC_CONF
+ *
+ * The string holds name:value pairs separated by commas, for instance
+ * "arenas:8,fit:first,decay_ms:0". Sizes take a k, m or g suffix, fit takes
+ * first, next or best, and prof_file names the file the heap profile is
+ * written to at exit. Runs inside the allocator's initialization, so it
+ * parses the string in place and never allocates. Bad entries are reported
+ * on stderr and skipped.
+ *
+ * @param conf The value of TUMALLOC_CONF, or NULL
+ */
+static void config_parse(const char *conf) {
+    while (conf != NULL && *conf != '\0') {
+        const char *end = strchr(conf, ',');
+        if (end == NULL) {
+            end = conf + strlen(conf);
+        }
+        const char *colon = memchr(conf, ':', end - conf);
+        int ok = 0;
 
-            prev->size += block->size + sizeof(free_block);
+        if (colon != NULL && colon + 1 < end) {
+            const char *value = colon + 1;
+            size_t value_length = end - value;
+            int id = option_find(conf, colon - conf);
 
-            // Ensure prev->next is updated to skip over 'block', only if 'block' is directly next to 'prev'.
-            if (prev->next == block) {
-                prev->next = block->next;
+            if (colon - conf == 9 && memcmp(conf, "prof_file", 9) == 0) {
+                if (value_length < sizeof(PROFILE_FILE)) {
+                    memcpy(PROFILE_FILE, value, value_length);
+                    PROFILE_FILE[value_length] = '\0';
+                    ok = 1;
+                }
+            } else if (id == OPT_FIT) {
+                const char *names[] = {[TUMALLOC_FIT_FIRST] = "first", [TUMALLOC_FIT_NEXT] = "next", [TUMALLOC_FIT_BEST] = "best"};
+                for (size_t policy = 0; policy < sizeof(names) / sizeof(names[0]); policy++) {
+                    if (strlen(names[policy]) == value_length && memcmp(names[policy], value, value_length) == 0) {
+                        ok = option_set(id, policy) == 0;
+                    }
+                }
+            } else if (id >= 0 && *value >= '0' && *value <= '9') {
+                char *suffix;
+                unsigned long long number = strtoull(value, &suffix, 10);
+                unsigned shift = 0;
+                if (suffix < end && (*suffix == 'k' || *suffix == 'K')) {
+                    shift = 10;
+                } else if (suffix < end && (*suffix == 'm' || *suffix == 'M')) {
+                    shift = 20;
+                } else if (suffix < end && (*suffix == 'g' || *suffix == 'G')) {
+                    shift = 30;
+                }
+                suffix += shift != 0;
+                ok = suffix == end && number <= (SIZE_MAX >> shift) && option_set(id, (size_t)number << shift) == 0;
             }
-            block = prev; // Update block to point to the new coalesced block.
         }
+
+        if (!ok) {
+            config_warn(conf, end - conf);
+        }
+        conf = *end == ',' ? end + 1 : end;
     }
+}
 
-    // Coalesce with next block if it is contiguous.
-    if (next != NULL) {
-        char *end_of_block = (char *)block + block->size + sizeof(free_block);
-        if (end_of_block == (char *)next) {
-            // If LAST_ALLOCATION_POINT is next, update it to block
-            if (LAST_ALLOCATION_POINT == next) {
-                LAST_ALLOCATION_POINT = block;
-            }
+/**
+ * Set up the arenas and the thread cache key
+ *
+ * Runs once, on the first slow path call. The TUMALLOC_ARENAS environment
+ * variable overrides the default of ARENAS_PER_CPU arenas per online CPU,
+ * TUMALLOC_MMAP_THRESHOLD the size from which blocks get their own mapping,
+ * and TUMALLOC_TRIM_THRESHOLD the top chunk size that gets trimmed. Both
+ * are held to the ranges of option_set, like TUMALLOC_CONF.
+ * TUMALLOC_DECAY_MS sets how long free pages stay dirty before they are
+ * purged, zero turns purging off. TUMALLOC_HUGEPAGES=1 backs the heaps and
+ * slabs with transparent huge pages, see heap_map. TUMALLOC_FIT picks
+ * first, next or best fit for blocks above the small classes.
+ * TUMALLOC_TRACE names a file to record every call in, and
+ * TUMALLOC_PROFILE turns on heap profile sampling, see prof_init.
+ * TUMALLOC_CONF comes last and overrides them all, see config_parse. Also
+ * installs the fork handlers that keep the locks consistent in the child.
+ */
+static void tumalloc_init(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long count = env_number("TUMALLOC_ARENAS", cpus > 0 ? (unsigned long)cpus * ARENAS_PER_CPU : 1);
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_ARENAS) {
+        count = MAX_ARENAS;
+    }
 
-            block->size += next->size + sizeof(free_block);
+    for (unsigned i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&ARENAS[i].lock, NULL);
+        ARENAS[i].index = (uint16_t)i;
+        ARENAS[i].grow_size = HEAP_GROW_MIN;
+    }
+    NUM_ARENAS = (unsigned)count;
 
-            // Ensure block->next is updated to skip over 'next'.
-            block->next = next->next;
-        }
+    PAGE_SIZE = (size_t)sysconf(_SC_PAGESIZE);
+    HUGE_PAGES = env_number("TUMALLOC_HUGEPAGES", 0) != 0;
+    env_option("TUMALLOC_MMAP_THRESHOLD", OPT_MMAP_THRESHOLD);
+    env_option("TUMALLOC_TRIM_THRESHOLD", OPT_TRIM_THRESHOLD);
+    env_option("TUMALLOC_DECAY_MS", OPT_DECAY_MS);
+    env_option("TUMALLOC_PROFILE", OPT_PROFILE);
+
+    const char *fit = getenv("TUMALLOC_FIT");
+    if (fit != NULL && strcmp(fit, "first") == 0) {
+        FIT_POLICY = TUMALLOC_FIT_FIRST;
+    } else if (fit != NULL && strcmp(fit, "next") == 0) {
+        FIT_POLICY = TUMALLOC_FIT_NEXT;
     }
 
-    return block;
+    config_parse(getenv("TUMALLOC_CONF"));
+    PURGE_PAGE = HUGE_PAGES ? HUGE_PAGE_SIZE : PAGE_SIZE;
+
+    slab_init();
+    trace_init();
+    prof_init(PROFILE_RATE, PROFILE_FILE[0] != '\0' ? PROFILE_FILE : NULL);
+    pthread_key_create(&TCACHE_KEY, tcache_shutdown);
+    pthread_atfork(fork_prepare, fork_release, fork_child);
 }
 
 /**
- * Call sbrk to get memory from the OS
+ * Set up the allocator unless a call already did
  *
- * @param size The amount of memory to allocate
- * @return A pointer to the allocated memory
+ * For the entry points in other files that read its state before anything
+ * was allocated, like tumalloc_stats.
  */
-void *do_alloc(size_t size) {
-    // Align size to be a multiple of ALIGNMENT
-    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+void tumalloc_ensure_init(void) {
+    pthread_once(&INIT_ONCE, tumalloc_init);
+}
 
-    // Request memory from the OS
-    size_t total_size = size + sizeof(header);
-    void *ptr = sbrk(total_size);
-    
-    if (ptr == (void *)-1) {
-        // sbrk failed
-        return NULL;
+/**
+ * Get the block that follows a block in memory
+ *
+ * @param h The block
+ * @return The header of the next block, which may be a fence
+ */
+static inline header *next_block(header *h) {
+    return (header *)((char *)h + sizeof(header) + h->size);
+}
+
+/**
+ * Write the footer of a free block
+ *
+ * @param block The free block
+ */
+static inline void set_footer(free_block *block) {
+    *(size_t *)((char *)block + sizeof(header) + block->size - sizeof(size_t)) = block->size;
+}
+
+/**
+ * File a free block, on the free list or in the tree of its size class
+ *
+ * Also marks the block as freed, writes its footer and tells the next block
+ * in memory that its predecessor is free. Tree blocks are stamped with the
+ * current purge epoch, which starts the decay of their dirty pages.
+ *
+ * @param a The arena owning the block
+ * @param block The block to insert
+ */
+static void insert_free_block(arena *a, free_block *block) {
+    block->magic = FREED_MAGIC;
+
+    if (block->size > SMALL_CLASS_MAX) {
+        ((tree_block *)block)->epoch = a->purge_epoch;
+        tree_insert(a, block);
+    } else {
+        unsigned cls = size_to_class(block->size);
+        block->prev = NULL;
+        block->next = a->bins[cls];
+        if (block->next != NULL) {
+            block->next->prev = block;
+        }
+        a->bins[cls] = block;
+        a->bin_map |= 1ULL << cls;
     }
-    
-    // Set up header
-    header *h = (header *)ptr;
-    h->size = size;
-    h->magic = MAGIC_NUMBER;
-    
-    // Return pointer after the header
-    return (void *)((char *)ptr + sizeof(header));
+
+    set_footer(block);
+    next_block((header *)block)->flags |= BLOCK_PREV_FREE;
 }
 
 /**
- * Allocates memory for the end user
+ * Split a block into two blocks
  *
- * @param size The amount of memory to allocate
- * @return A pointer to the requested block of memory
+ * The first block keeps size bytes and the tail becomes a new free block,
+ * which is filed by its own size. The first block is assumed to be in use.
+ *
+ * @param a The arena owning the block
+ * @param block The block to split
+ * @param size The size of the first new split block
+ * @return A pointer to the first block or NULL if the block cannot be split
  */
-void *tumalloc(size_t size) {
-    // Handle zero size request
-    if (size == 0) {
+static void *split(arena *a, free_block *block, size_t size) {
+    if (block->size < size + sizeof(header) + MIN_BLOCK_SIZE) {
         return NULL;
     }
 
-    // Align size to be a multiple of ALIGNMENT
-    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    void *split_pnt = (char *)block + size + sizeof(header);
+    free_block *new_block = (free_block *) split_pnt;
 
-    // If the free list is empty, allocate from the OS
-    if (HEAD == NULL) {
-        LAST_ALLOCATION_POINT = NULL;
-        return do_alloc(size);
-    }
-    
-    // Prepare for Next Fit search
-    free_block *start;
-    free_block *curr;
-    
-    // Start from the last allocation point, or HEAD if no previous allocation
-    if (LAST_ALLOCATION_POINT == NULL) {
-        start = HEAD;
-    } else {
-        start = LAST_ALLOCATION_POINT;
-    }
-    
-    curr = start;
-    
-    // First, try to find a block from the current position to the end
-    do {
-        // Check if current block is big enough
-        if (curr->size >= size) {
-            // Split the block if it's large enough
-            header *h = (header *)split(curr, size);
-            
-            if (h != NULL) {
-                // Update last allocation point
-                LAST_ALLOCATION_POINT = curr->next;
-                
-                // Remove the block from the free list
-                remove_free_block(curr);
-                
-                // Set up the header
-                h->size = size;
-                h->magic = MAGIC_NUMBER;
-                
-                // Return pointer after the header
-                return (void *)((char *)h + sizeof(header));
-            }
-        }
-        
-        // Move to the next block
-        curr = curr->next;
-        
-        // If we've reached the end, wrap around to the beginning
-        if (curr == NULL) {
-            curr = HEAD;
-        }
-    } while (curr != start);  // Stop when we've examined all blocks
-    
-    // If we get here, no suitable block was found in the free list
-    return do_alloc(size);
+    new_block->size = block->size - size - sizeof(header);
+    new_block->flags = 0;
+    new_block->arena = block->arena;
+    insert_free_block(a, new_block);
+
+    block->size = size;
+
+    return block;
 }
 
 /**
- * Allocates and initializes a list of elements for the end user
+ * Find the previous neighbor of a block
  *
- * @param num How many elements to allocate
- * @param size The size of each element
- * @return A pointer to the requested block of initialized memory
+ * @param block The block to find the previous neighbor of
+ * @return A pointer to the previous neighbor or NULL if it is not free
  */
-void *tucalloc(size_t num, size_t size) {
-    // Calculate total size
-    size_t total_size = num * size;
-    
-    // Handle overflow
-    if (num > 0 && total_size / num != size) {
+static free_block *find_prev(free_block *block) {
+    if (!(block->flags & BLOCK_PREV_FREE)) {
         return NULL;
     }
-    
-    // Allocate memory
-    void *ptr = tumalloc(total_size);
-    
-    if (ptr != NULL) {
-        // Initialize memory to zero
-        memset(ptr, 0, total_size);
+
+    size_t prev_size = *(size_t *)((char *)block - sizeof(size_t));
+    return (free_block *)((char *)block - prev_size - sizeof(header));
+}
+
+/**
+ * Find the next neighbor of a block
+ *
+ * @param block The block to find the next neighbor of
+ * @return A pointer to the next neighbor or NULL if it is not free
+ */
+static free_block *find_next(free_block *block) {
+    header *next = next_block((header *)block);
+
+    if (next->magic != FREED_MAGIC) {
+        return NULL;
     }
-    
-    return ptr;
+    return (free_block *)next;
 }
 
 /**
- * Removes used chunk of memory and returns it to the free list
+ * Take a block off the free list or out of the tree of its size class
  *
- * @param ptr Pointer to the allocated piece of memory
+ * @param a The arena owning the block
+ * @param block The block to remove, with the size it was filed under
  */
-void tufree(void *ptr) {
-    // Handle NULL pointer
-    if (ptr == NULL) {
+static void remove_free_block(arena *a, free_block *block) {
+    if (block->size > SMALL_CLASS_MAX) {
+        tree_remove(a, block);
         return;
     }
-    
-    // Get the header for the pointer
-    header *h = (header *)((char *)ptr - sizeof(header));
-    
-    // Check if the block is already freed (double free protection)
-    if (h->magic == FREED_MAGIC) {
-        // Block is already freed, just return
-        return;
+
+    unsigned cls = size_to_class(block->size);
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        a->bins[cls] = block->next;
+        if (a->bins[cls] == NULL) {
+            a->bin_map &= ~(1ULL << cls);
+        }
     }
-    
-    // Verify the magic number
-    if (h->magic != MAGIC_NUMBER) {
-        printf("MEMORY CORRUPTION DETECTED\n");
-        abort();
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
     }
-    
-    // Mark the block as freed
-    h->magic = FREED_MAGIC;
-    
-    // Convert the header to a free block
-    free_block *block = (free_block *)h;
-    block->size = h->size;
-    
-    // Add the block to the free list
-    block->next = HEAD;
-    HEAD = block;
-    
-    // Coalesce the block with any neighboring free blocks
-    coalesce(block);
 }
 
 /**
- * Reallocates a chunk of memory with a bigger size
+ * Write a fence block
  *
- * @param ptr A pointer to an already allocated piece of memory
- * @param new_size The new requested size to allocate
- * @return A new pointer containing the contents of ptr, but with the new_size
+ * @param a The arena owning the segment
+ * @param fence Where the fence goes
+ * @param flags BLOCK_PREV_FREE if the top chunk sits right before the fence
  */
-void *turealloc(void *ptr, size_t new_size) {
-    // Handle NULL pointer
-    if (ptr == NULL) {
-        return tumalloc(new_size);
-    }
-    
-    // Handle zero size
-    if (new_size == 0) {
-        tufree(ptr);
-        return NULL;
+static void set_fence(arena *a, header *fence, uint16_t flags) {
+    fence->size = 0;
+    fence->magic = MAGIC_NUMBER;
+    fence->flags = BLOCK_FENCE | flags;
+    fence->arena = a->index;
+}
+
+/**
+ * Give the unused end of a large top chunk back to the OS
+ *
+ * Keeps HEAP_GROW_MIN bytes so the next growth is not needed right away.
+ * The main arena lowers the break when it still owns the end of it. Every
+ * other case drops the dirty pages with madvise and keeps the mapping, and
+ * only once there is at least HEAP_GROW_MIN to drop.
+ *
+ * @param a The arena to trim
+ */
+static void trim_top(arena *a) {
+    free_block *top = a->top;
+    char *payload = (char *)top + sizeof(header);
+    char *footer = payload + top->size - sizeof(size_t);
+    size_t release;
+
+    // Without a page above the part we keep there is nothing to give back
+    if (top->size <= __atomic_load_n(&TRIM_THRESHOLD, __ATOMIC_RELAXED) || top->size <= HEAP_GROW_MIN + PAGE_SIZE) {
+        return;
     }
-    
-    // Get the header for the pointer
-    header *h = (header *)((char *)ptr - sizeof(header));
-    
-    // Verify the magic number
-    if (h->magic != MAGIC_NUMBER) {
-        // Check if it's a freed pointer that we're trying to reuse
-        if (h->magic == FREED_MAGIC) {
-            // We'll handle this like a malloc instead
-            return tumalloc(new_size);
+
+    if (a->index == 0 && !HUGE_PAGES && sbrk(0) == a->end) {
+        // Lower the break and move the fence down with it
+        release = (top->size - HEAP_GROW_MIN) & ~(PAGE_SIZE - 1);
+        if (release == 0 || sbrk(-(intptr_t)release) == (void *)-1) {
+            return;
         }
-        printf("MEMORY CORRUPTION DETECTED\n");
-        abort();
-    }
-    
-    // If the new size is smaller or equal to the current size, just return the same pointer
-    if (new_size <= h->size) {
-        return ptr;
+
+        top->size -= release;
+        set_footer(top);
+        a->fence = (header *)((char *)a->fence - release);
+        set_fence(a, a->fence, BLOCK_PREV_FREE);
+        a->end -= release;
+        a->heap_size -= release;
+        pagemap_set(a->end, release, 0);
+        if (a->top_clean > footer - release) {
+            a->top_clean = footer - release;
+        }
+    } else {
+        // Drop the dirty pages above the part we keep, whole huge pages only when they back the heap
+        char *dirty = a->top_clean < footer ? a->top_clean : footer;
+        char *start = (char *)(((uintptr_t)payload + HEAP_GROW_MIN + PURGE_PAGE - 1) & ~(uintptr_t)(PURGE_PAGE - 1));
+        char *end = (char *)((uintptr_t)dirty & ~(uintptr_t)(PURGE_PAGE - 1));
+        if (end < start + HEAP_GROW_MIN || madvise(start, end - start, MADV_DONTNEED) != 0) {
+            return;
+        }
+
+        // What is left of the last page is cleared by hand, so all of it up to the footer is clean
+        memset(end, 0, dirty - end);
+        release = end - start;
+        a->top_clean = start;
     }
-    
-    // Allocate new memory
-    void *new_ptr = tumalloc(new_size);
-    
-    if (new_ptr == NULL) {
+
+    a->bytes_returned += release;
+    a->trim_calls++;
+    a->grow_size = HEAP_GROW_MIN;
+}
+
+/**
+ * Drop the whole pages between two addresses
+ *
+ * With huge pages on, only whole huge pages are dropped, so the kernel
+ * never has to split one.
+ *
+ * @param a The arena owning the memory
+ * @param start The first byte that may be dropped
+ * @param end The first byte after them
+ * @return The number of bytes dropped
+ */
+static size_t purge_range(arena *a, char *start, char *end) {
+    start = (char *)(((uintptr_t)start + PURGE_PAGE - 1) & ~(uintptr_t)(PURGE_PAGE - 1));
+    end = (char *)((uintptr_t)end & ~(uintptr_t)(PURGE_PAGE - 1));
+    if (end <= start || madvise(start, end - start, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+
+    a->purge_calls++;
+    a->bytes_purged += end - start;
+    return end - start;
+}
+
+/**
+ * Purge the free blocks of a tree that were freed in an epoch up to before
+ *
+ * The tree links at the start of a block and its footer stay, everything
+ * in between reads back as zeros once it is touched again.
+ *
+ * @param a The arena owning the tree
+ * @param t The subtree, or NULL
+ * @param before The last epoch to purge
+ * @return The number of bytes dropped
+ */
+static size_t purge_tree(arena *a, tree_block *t, uint64_t before) {
+    size_t purged = 0;
+
+    for (; t != NULL; t = t->right) {
+        purged += purge_tree(a, t->left, before);
+        if (t->epoch != EPOCH_PURGED && t->epoch <= before) {
+            char *footer = (char *)t + sizeof(header) + t->block.size - sizeof(size_t);
+            purged += purge_range(a, (char *)(t + 1), footer);
+            t->epoch = EPOCH_PURGED;
+        }
+    }
+    return purged;
+}
+
+/**
+ * Give the dirty pages of free blocks freed in an epoch up to before back to the OS
+ *
+ * Covers the free trees and the top chunk. Blocks up to SMALL_CLASS_MAX
+ * never hold a whole page and are left alone. The caller must hold the
+ * arena lock.
+ *
+ * @param a The arena to purge
+ * @param before The last epoch to purge
+ * @return The number of bytes dropped
+ */
+static size_t arena_purge(arena *a, uint64_t before) {
+    size_t purged = 0;
+
+    for (unsigned cls = SMALL_CLASS_COUNT; cls < NUM_SIZE_CLASSES; cls++) {
+        purged += purge_tree(a, a->trees[cls - SMALL_CLASS_COUNT], before);
+    }
+
+    if (a->top != NULL && a->top_epoch <= before) {
+        char *payload = (char *)a->top + sizeof(header);
+        char *footer = payload + a->top->size - sizeof(size_t);
+        char *dirty = a->top_clean < footer ? a->top_clean : footer;
+        size_t dropped = purge_range(a, payload, dirty);
+        if (dropped > 0) {
+            // Clear the rest of the last page, so all of it up to the footer is clean
+            char *start = (char *)(((uintptr_t)payload + PURGE_PAGE - 1) & ~(uintptr_t)(PURGE_PAGE - 1));
+            memset(start + dropped, 0, dirty - (start + dropped));
+            a->top_clean = start;
+            purged += dropped;
+        }
+    }
+    return purged;
+}
+
+/**
+ * Advance the purge epoch of an arena and purge what decayed
+ *
+ * Runs when a thread locks the arena to allocate, at most once per
+ * PURGE_INTERVAL. An arena nobody locked for a while catches up on all the
+ * ticks it missed. A block is purged once DECAY_TICKS whole ticks passed
+ * since it was freed, so its pages stayed dirty for at least the decay
+ * time. The caller must hold the arena lock.
+ *
+ * @param a The arena
+ */
+static void arena_decay(arena *a) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+
+    // tumallctl may turn purging off in the meantime
+    uint64_t interval = __atomic_load_n(&PURGE_INTERVAL, __ATOMIC_RELAXED);
+    if (now < a->next_purge || interval == 0) {
+        return;
+    }
+
+    a->purge_epoch += 1 + (now - a->next_purge) / interval;
+    a->next_purge = now + interval;
+    if (a->purge_epoch > DECAY_TICKS) {
+        arena_purge(a, a->purge_epoch - DECAY_TICKS - 1);
+    }
+}
+
+/**
+ * Coalesce neighboring free blocks
+ *
+ * The block must not be on any free list yet. Contiguous neighbors are taken
+ * off their lists and merged, and the result is filed under its new class.
+ * A block that ends up right before the arena's fence becomes the top chunk
+ * instead, which may then be trimmed.
+ *
+ * @param a The arena owning the block
+ * @param block The block to coalesce
+ * @return A pointer to the first block of the coalesced blocks
+ */
+static void *coalesce(arena *a, free_block *block) {
+    if (block == NULL) {
+        return NULL;
+    }
+
+    free_block *prev = find_prev(block);
+    free_block *next = find_next(block);
+
+    // Coalesce with previous block if it is free.
+    if (prev != NULL) {
+        remove_free_block(a, prev);
+        prev->size += block->size + sizeof(header);
+        block = prev; // Update block to point to the new coalesced block.
+    }
+
+    // Merge into the top chunk, or become it
+    if ((next != NULL && next == a->top) || (a->top == NULL && next_block((header *)block) == a->fence)) {
+        if (next != NULL) {
+            block->size += next->size + sizeof(header);
+        } else {
+            a->top_clean = (char *)block + sizeof(header) + block->size - sizeof(size_t);
+        }
+        block->magic = FREED_MAGIC;
+        set_footer(block);
+        a->fence->flags |= BLOCK_PREV_FREE;
+        a->top = block;
+        a->top_epoch = a->purge_epoch;
+        trim_top(a);
+        return block;
+    }
+
+    // Coalesce with next block if it is free.
+    if (next != NULL) {
+        remove_free_block(a, next);
+        block->size += next->size + sizeof(header);
+    }
+
+    insert_free_block(a, block);
+
+    return block;
+}
+
+/**
+ * Find a free block that can hold size bytes and take it off its free list
+ *
+ * Every block in a small class holds exactly its class size, so a small
+ * request takes the head of its own class or, through the bitmap, of the
+ * smallest larger small class that has one. Everything else comes from the
+ * trees of the larger classes, picked by the fit policy.
+ *
+ * @param a The arena to search
+ * @param size The aligned size to look for
+ * @return A block of at least size bytes or NULL if there is none
+ */
+static free_block *find_fit(arena *a, size_t size) {
+    free_block *block = NULL;
+
+    if (size <= SMALL_CLASS_MAX) {
+        uint32_t fits = (uint32_t)a->bin_map & (~0U << size_to_class(size));
+        if (fits != 0) {
+            block = a->bins[__builtin_ctz(fits)];
+        }
+    }
+
+    if (block == NULL) {
+        block = tree_find(a, size, __atomic_load_n(&FIT_POLICY, __ATOMIC_RELAXED));
+    }
+
+    if (block != NULL) {
+        remove_free_block(a, block);
+    }
+
+    return block;
+}
+
+/**
+ * Map huge page aligned memory for an arena heap
+ *
+ * Tries to map right after the arena's last segment first, so the top
+ * chunk keeps growing in place. Otherwise maps a huge page more than asked
+ * and cuts the mapping down to an aligned range. Either way the memory is
+ * advised for transparent huge pages, which the kernel backs it with as it
+ * is touched.
+ *
+ * @param a The arena to grow
+ * @param size The number of bytes, a multiple of HUGE_PAGE_SIZE
+ * @return The memory, or NULL if the OS is out of memory
+ */
+static char *heap_map(arena *a, size_t size) {
+    char *ptr = NULL;
+
+    if (a->end != NULL && ((uintptr_t)a->end & (HUGE_PAGE_SIZE - 1)) == 0) {
+        char *next = mmap(a->end, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (next == a->end) {
+            ptr = next;
+        } else if (next != MAP_FAILED) {
+            // Kernels before 4.17 take the address as a mere hint
+            munmap(next, size);
+        }
+    }
+
+    if (ptr == NULL) {
+        char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        ptr = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (ptr > raw) {
+            munmap(raw, ptr - raw);
+        }
+        if (raw + HUGE_PAGE_SIZE > ptr) {
+            munmap(ptr + size, raw + HUGE_PAGE_SIZE - ptr);
+        }
+    }
+
+    madvise(ptr, size, MADV_HUGEPAGE);
+    return ptr;
+}
+
+/**
+ * Grow the top chunk of an arena by at least size bytes
+ *
+ * The heap is made of segments that end in a fence block, so walking to the
+ * next block never leaves memory we own. The main arena calls sbrk and the
+ * others mmap. Growth comes in steps of grow_size, which doubles every time
+ * up to GROW_MAX. When the new memory starts right after our last fence,
+ * the top chunk takes over that fence and simply grows. Otherwise the new
+ * memory starts a new segment and the old top chunk joins the free lists.
+ * Every page of the new memory is entered in the page map under the arena.
+ * With huge pages on, every arena grows through heap_map in whole huge
+ * pages, the main arena included.
+ *
+ * @param a The arena to grow
+ * @param size The number of bytes the top chunk must gain
+ * @return Non-zero on success, zero if the OS is out of memory
+ */
+static int grow_top(arena *a, size_t size) {
+    // Cover the worst case of a fresh, misaligned segment
+    size_t total_size = size + 2 * sizeof(header) + ALIGNMENT;
+    if (total_size < a->grow_size) {
+        total_size = a->grow_size;
+    }
+    size_t granule = HUGE_PAGES ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    total_size = (total_size + granule - 1) & ~(granule - 1);
+
+    // Request memory from the OS
+    char *ptr;
+    if (HUGE_PAGES) {
+        ptr = heap_map(a, total_size);
+        if (ptr == NULL) {
+            return 0;
+        }
+    } else if (a->index == 0) {
+        ptr = sbrk(total_size);
+        if (ptr == (void *)-1) {
+            // sbrk failed
+            return 0;
+        }
+    } else {
+        ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return 0;
+        }
+    }
+    if (!pagemap_set(ptr, total_size, PAGE_HEAP_ENTRY(a->index))) {
+        if (a->index == 0 && !HUGE_PAGES) {
+            sbrk(-(intptr_t)total_size);
+        } else {
+            munmap(ptr, total_size);
+        }
+        return 0;
+    }
+    a->grow_calls++;
+    a->heap_size += total_size;
+    if (a->grow_size < __atomic_load_n(&GROW_MAX, __ATOMIC_RELAXED)) {
+        a->grow_size *= 2;
+    }
+
+    // The new fence goes in the last aligned slot
+    header *fence = (header *)(((uintptr_t)ptr + total_size - sizeof(header)) & ~(uintptr_t)(ALIGNMENT - 1));
+    free_block *top;
+
+    if (a->fence != NULL && ptr == a->end) {
+        // Grow the current segment over the old fence
+        header *old_fence = a->fence;
+        if (a->top != NULL) {
+            top = a->top;
+            char *old_footer = (char *)old_fence - sizeof(size_t);
+            if (a->top_clean < old_footer) {
+                // Keep the clean tail contiguous with the new memory
+                memset(old_footer, 0, sizeof(size_t) + sizeof(header));
+            } else {
+                a->top_clean = (char *)old_fence + sizeof(header);
+            }
+        } else {
+            top = (free_block *)old_fence;
+            top->flags = 0;
+            a->top_clean = (char *)old_fence + sizeof(header);
+        }
+    } else {
+        // Start a new segment and retire the old top chunk
+        if (a->top != NULL) {
+            insert_free_block(a, a->top);
+        }
+        top = (free_block *)(((uintptr_t)ptr + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+        top->flags = 0;
+        a->top_clean = (char *)top + sizeof(header);
+    }
+
+    top->size = (char *)fence - (char *)top - sizeof(header);
+    top->magic = FREED_MAGIC;
+    top->arena = a->index;
+    set_footer(top);
+    set_fence(a, fence, BLOCK_PREV_FREE);
+
+    a->top = top;
+    a->fence = fence;
+    a->end = ptr + total_size;
+
+    return 1;
+}
+
+/**
+ * Carve a new block out of the top chunk of an arena
+ *
+ * Only grows the heap when the top chunk is too small, so most misses on
+ * the free lists cost no syscall at all.
+ *
+ * @param a The arena to allocate from
+ * @param size The aligned size of the block
+ * @param zero Where the part of the payload the top chunk never wrote goes, or NULL
+ * @return A pointer to the allocated memory
+ */
+static void *do_alloc(arena *a, size_t size, zero_range *zero) {
+    size_t needed = size + sizeof(header) + MIN_BLOCK_SIZE;
+
+    a->top_allocs++;
+    if (a->top == NULL || a->top->size < needed) {
+        if (!grow_top(a, needed)) {
+            // Out of memory, hand out the whole top chunk if it is enough
+            if (a->top == NULL || a->top->size < size) {
+                return NULL;
+            }
+            header *h = (header *)a->top;
+            h->magic = MAGIC_NUMBER;
+            a->fence->flags &= ~BLOCK_PREV_FREE;
+            a->top = NULL;
+            if (zero != NULL) {
+                zero->start = zero->end = NULL;
+            }
+            return (void *)((char *)h + sizeof(header));
+        }
+    } else {
+        a->syscalls_avoided++;
+    }
+
+    // The block takes the start of the top chunk and the rest stays on top
+    free_block *top = a->top;
+    free_block *rest = (free_block *)((char *)top + sizeof(header) + size);
+    if (zero != NULL) {
+        zero->start = a->top_clean;
+        zero->end = (char *)rest;
+    }
+    rest->size = top->size - size - sizeof(header);
+    rest->magic = FREED_MAGIC;
+    rest->flags = 0;
+    rest->arena = a->index;
+    set_footer(rest);
+    a->top = rest;
+    if (a->top_clean < (char *)rest + sizeof(header)) {
+        a->top_clean = (char *)rest + sizeof(header);
+    }
+
+    // Set up header
+    header *h = (header *)top;
+    h->size = size;
+    h->magic = MAGIC_NUMBER;
+
+    // Return pointer after the header
+    return (void *)((char *)h + sizeof(header));
+}
+
+/**
+ * Get the start of the mapping holding a mapped block
+ *
+ * The header sits somewhere in the first page of its mapping, at the very
+ * start unless the block was allocated with a larger alignment.
+ *
+ * @param h The header of the mapped block
+ * @return The start of the mapping
+ */
+static inline char *mmap_base(header *h) {
+    return (char *)((uintptr_t)h & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+/**
+ * Give a large block its own mapping
+ *
+ * The header sits in the first page of the mapping and the size covers the
+ * whole rest of it, so tufree can munmap it without any bookkeeping. For a
+ * larger alignment we map alignment more bytes and unmap the pages on both
+ * sides of the aligned block. Only the page holding the payload start goes
+ * in the page map, since that is the only pointer tufree can get.
+ *
+ * @param alignment The alignment of the payload, a power of two
+ * @param size The aligned size of the block
+ * @return A pointer to the payload or NULL if the mapping failed
+ */
+static void *mmap_alloc(size_t alignment, size_t size) {
+    size_t slack = alignment > ALIGNMENT ? alignment : 0;
+    size_t total_size = (size + sizeof(header) + slack + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    char *ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Cut the mapping down to the pages the aligned block needs
+    char *payload = (char *)(((uintptr_t)ptr + sizeof(header) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    char *start = (char *)((uintptr_t)(payload - sizeof(header)) & ~(uintptr_t)(PAGE_SIZE - 1));
+    char *end = (char *)(((uintptr_t)payload + size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (start > ptr) {
+        munmap(ptr, start - ptr);
+    }
+    if (end < ptr + total_size) {
+        munmap(end, ptr + total_size - end);
+    }
+
+    header *h = (header *)payload - 1;
+    if (!pagemap_set(payload, 1, (uintptr_t)h | PAGE_LARGE)) {
+        munmap(start, end - start);
+        return NULL;
+    }
+
+    h->size = end - payload;
+    h->magic = MAGIC_NUMBER;
+    h->flags = BLOCK_MMAPPED;
+    h->arena = 0;
+
+    STAT_ADD_SHARED(LARGE_STATS.mmap_calls, 1);
+    STAT_ADD_SHARED(LARGE_STATS.count, 1);
+    STAT_ADD_SHARED(LARGE_STATS.bytes, end - start);
+
+    return payload;
+}
+
+/**
+ * Resize a mapped block with mremap
+ *
+ * The kernel moves the pages if it has to, so the data is never copied.
+ * When the mapping cannot grow where it is, we map the destination first
+ * and enter it in the page map, so the move itself can no longer fail
+ * halfway. The offset of the header in its first page is kept, which keeps
+ * alignments up to the page size.
+ *
+ * @param h The header of the mapped block
+ * @param size The aligned new size of the block
+ * @return A pointer to the payload or NULL if the mapping could not be resized
+ */
+static void *mmap_resize(header *h, size_t size) {
+    char *base = mmap_base(h);
+    size_t offset = (char *)h - base;
+    size_t old_size = (char *)(h + 1) + h->size - base;
+    size_t total_size = (offset + sizeof(header) + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    char *moved = mremap(base, old_size, total_size, 0);
+    if (moved == MAP_FAILED) {
+        char *dest = mmap(NULL, total_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dest == MAP_FAILED) {
+            return NULL;
+        }
+        header *moved_h = (header *)(dest + offset);
+        if (!pagemap_set(moved_h + 1, 1, (uintptr_t)moved_h | PAGE_LARGE)) {
+            munmap(dest, total_size);
+            return NULL;
+        }
+        // Once moved, the old pages may be mapped again by another thread
+        // right away, so their entry has to go first
+        pagemap_set(h + 1, 1, 0);
+        moved = mremap(base, old_size, total_size, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+        if (moved == MAP_FAILED) {
+            pagemap_set(h + 1, 1, (uintptr_t)h | PAGE_LARGE);
+            pagemap_set(moved_h + 1, 1, 0);
+            munmap(dest, total_size);
+            return NULL;
+        }
+        h = moved_h;
+    }
+    STAT_ADD_SHARED(LARGE_STATS.mremap_calls, 1);
+    STAT_ADD_SHARED(LARGE_STATS.bytes, total_size - old_size);
+    h->size = total_size - offset - sizeof(header);
+
+    return (void *)((char *)h + sizeof(header));
+}
+
+/**
+ * Allocate a block from an arena
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param a The arena to allocate from
+ * @param size The aligned size of the block, at least MIN_BLOCK_SIZE
+ * @param zero Where the part of the payload known to be zero goes, or NULL
+ * @return A pointer to the payload or NULL if the OS is out of memory
+ */
+static void *heap_alloc(arena *a, size_t size, zero_range *zero) {
+    // Take the smallest size class that can serve the request
+    free_block *block = find_fit(a, size);
+
+    // If no free block is big enough, allocate from the OS
+    if (block == NULL) {
+        return do_alloc(a, size, zero);
+    }
+
+    // A purged block reads as zeros between its tree links and its footer
+    if (zero != NULL) {
+        zero->start = zero->end = NULL;
+        if (block->size > SMALL_CLASS_MAX && ((tree_block *)block)->epoch == EPOCH_PURGED) {
+            zero->start = (char *)(((uintptr_t)((tree_block *)block + 1) + PURGE_PAGE - 1) & ~(uintptr_t)(PURGE_PAGE - 1));
+            zero->end = (char *)((uintptr_t)((char *)block + sizeof(header) + block->size - sizeof(size_t)) & ~(uintptr_t)(PURGE_PAGE - 1));
+        }
+    }
+
+    // Give the unused tail back to the free lists if it is large enough
+    split(a, block, size);
+
+    // Set up the header and tell the next block we are in use
+    header *h = (header *)block;
+    h->magic = MAGIC_NUMBER;
+    next_block(h)->flags &= ~BLOCK_PREV_FREE;
+
+    // Return pointer after the header
+    return (void *)((char *)h + sizeof(header));
+}
+
+/**
+ * Carve a run of same-size blocks out of one free region of an arena
+ *
+ * The region is a free block that holds the whole run, or else the top
+ * chunk, grown once if needed. The blocks are laid out back to back in a
+ * single pass, and what is left of the region stays free. Runs are capped at
+ * GROW_MAX bytes, so call again for the rest. The caller must hold the
+ * arena lock.
+ *
+ * @param a The arena to allocate from
+ * @param size The aligned size of each block, at least MIN_BLOCK_SIZE
+ * @param out Where the payload pointers go
+ * @param count How many blocks are wanted
+ * @return How many blocks were carved, zero if the OS is out of memory
+ */
+static size_t heap_carve(arena *a, size_t size, void **out, size_t count) {
+    size_t stride = size + sizeof(header);
+    size_t limit = __atomic_load_n(&GROW_MAX, __ATOMIC_RELAXED) / stride;
+    if (count > limit) {
+        count = limit > 0 ? limit : 1;
+    }
+
+    char *start;
+    size_t avail;
+    free_block *region = find_fit(a, count * stride - sizeof(header));
+    if (region == NULL) {
+        size_t needed = count * stride + MIN_BLOCK_SIZE;
+        a->top_allocs++;
+        if (a->top == NULL || a->top->size < needed) {
+            if (!grow_top(a, needed)) {
+                void *ptr = heap_alloc(a, size, NULL);
+                out[0] = ptr;
+                return ptr != NULL;
+            }
+        } else {
+            a->syscalls_avoided++;
+        }
+        region = a->top;
+    }
+    start = (char *)region;
+    // The first block's header overwrites the region's
+    avail = region->size + sizeof(header);
+
+    size_t n = 0;
+    header *h = NULL;
+    for (; n < count; n++) {
+        h = (header *)(start + n * stride);
+        h->size = size;
+        h->magic = MAGIC_NUMBER;
+        h->flags = 0;
+        h->arena = a->index;
+        out[n] = h + 1;
+    }
+    char *end = start + n * stride;
+
+    if (region == a->top) {
+        free_block *rest = (free_block *)end;
+        rest->size = avail - n * stride - sizeof(header);
+        rest->magic = FREED_MAGIC;
+        rest->flags = 0;
+        rest->arena = a->index;
+        set_footer(rest);
+        a->top = rest;
+        if (a->top_clean < (char *)rest + sizeof(header)) {
+            a->top_clean = (char *)rest + sizeof(header);
+        }
+    } else if (avail - n * stride >= sizeof(header) + MIN_BLOCK_SIZE) {
+        // Give the unused tail back to the free lists
+        free_block *tail = (free_block *)end;
+        tail->size = avail - n * stride - sizeof(header);
+        tail->flags = 0;
+        tail->arena = a->index;
+        insert_free_block(a, tail);
+    } else {
+        // Too little left for a block of its own, the last block takes it
+        h->size += avail - n * stride;
+        next_block(h)->flags &= ~BLOCK_PREV_FREE;
+    }
+
+    return n;
+}
+
+/**
+ * Count a heap block handed out to the program
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param a The arena owning the block
+ * @param ptr The payload of the block, or NULL when the allocation failed
+ */
+static inline void heap_count_alloc(arena *a, void *ptr) {
+    if (ptr != NULL) {
+        header *h = (header *)ptr - 1;
+        a->allocs[size_to_class(h->size)]++;
+        a->allocated += h->size;
+    }
+}
+
+/**
+ * Count a heap block taken back from the program
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param a The arena owning the block
+ * @param h The block
+ */
+static inline void heap_count_free(arena *a, header *h) {
+    a->frees[size_to_class(h->size)]++;
+    a->allocated -= h->size;
+}
+
+/**
+ * Resize a heap block without moving it
+ *
+ * Shrinking splits off the tail and frees it. Growing takes the needed
+ * space from the next block when it is free, or from the top chunk when the
+ * block sits right below it, growing the heap first if the top is too small.
+ * The caller must hold the lock of the arena owning the block.
+ *
+ * @param a The arena owning the block
+ * @param h The block to resize
+ * @param size The aligned new size, at least MIN_BLOCK_SIZE
+ * @return Non-zero if the block now holds size bytes
+ */
+static int heap_resize(arena *a, header *h, size_t size) {
+    // Shrink by splitting off a tail that can live on its own
+    if (size <= h->size) {
+        if (h->size - size >= sizeof(header) + MIN_BLOCK_SIZE) {
+            free_block *tail = (free_block *)((char *)h + sizeof(header) + size);
+            tail->size = h->size - size - sizeof(header);
+            tail->magic = MAGIC_NUMBER;
+            tail->flags = 0;
+            tail->arena = h->arena;
+            h->size = size;
+            coalesce(a, tail);
+        }
+        return 1;
+    }
+
+    header *next = next_block(h);
+
+    // The block is the last one before the fence, grow a top chunk behind it
+    if (next == a->fence && a->top == NULL) {
+        if (!grow_top(a, size - h->size + sizeof(header) + MIN_BLOCK_SIZE) || next != (header *)a->top) {
+            return 0;
+        }
+    }
+
+    // Extend into the top chunk, which must keep room for its own header
+    if (next == (header *)a->top) {
+        size_t needed = size - h->size + sizeof(header) + MIN_BLOCK_SIZE;
+        if (a->top->size + sizeof(header) < needed
+            && (!grow_top(a, needed) || next != (header *)a->top)) {
+            return 0;
+        }
+
+        free_block *top = a->top;
+        free_block *rest = (free_block *)((char *)h + sizeof(header) + size);
+        rest->size = top->size - (size - h->size);
+        rest->magic = FREED_MAGIC;
+        rest->flags = 0;
+        rest->arena = a->index;
+        set_footer(rest);
+        a->top = rest;
+        if (a->top_clean < (char *)rest + sizeof(header)) {
+            a->top_clean = (char *)rest + sizeof(header);
+        }
+        h->size = size;
+        return 1;
+    }
+
+    // Absorb a free neighbor and give back what is left of it
+    if (next->magic == FREED_MAGIC && h->size + sizeof(header) + next->size >= size) {
+        remove_free_block(a, (free_block *)next);
+        h->size += sizeof(header) + next->size;
+        next_block(h)->flags &= ~BLOCK_PREV_FREE;
+        split(a, (free_block *)h, size);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate a heap block whose payload has a larger alignment
+ *
+ * Takes a block with room for the alignment plus a whole free block in
+ * front of it, then frees the leading slack and shrinks away the tail, so
+ * neither stays wasted. The caller must hold the arena lock.
+ *
+ * @param a The arena to allocate from
+ * @param alignment The alignment of the payload, a power of two above ALIGNMENT
+ * @param size The aligned size of the block, at least MIN_BLOCK_SIZE
+ * @return A pointer to the aligned payload or NULL if the OS is out of memory
+ */
+static void *heap_alloc_aligned(arena *a, size_t alignment, size_t size) {
+    char *ptr = heap_alloc(a, size + alignment + sizeof(header) + MIN_BLOCK_SIZE, NULL);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    header *h = (header *)ptr - 1;
+    if (((uintptr_t)ptr & (alignment - 1)) != 0) {
+        // The slack in front must be able to live as a free block
+        char *aligned = (char *)(((uintptr_t)ptr + sizeof(header) + MIN_BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        header *ah = (header *)aligned - 1;
+        ah->size = ptr + h->size - aligned;
+        ah->magic = MAGIC_NUMBER;
+        ah->flags = 0;
+        ah->arena = a->index;
+
+        h->size = (char *)ah - ptr;
+        coalesce(a, (free_block *)h);
+        h = ah;
+    }
+
+    heap_resize(a, h, size);
+    return (void *)(h + 1);
+}
+
+/**
+ * Lock an arena for the calling thread to allocate from
+ *
+ * Threads are spread over the arenas round robin. When a thread finds its
+ * arena locked, it tries the others and moves to the first one that is free,
+ * and only waits if every arena is busy. Blocks other threads freed into the
+ * arena meanwhile are taken back first, and pages that stayed dirty and
+ * free for the decay time are purged. A thread that moves also drains the
+ * arena it left, should that have become free in the meantime, since the
+ * blocks it allocated there now come back through the remote list.
+ *
+ * @return The locked arena
+ */
+static arena *arena_lock(void) {
+    arena *a = THREAD_ARENA;
+
+    if (a == NULL) {
+        pthread_once(&INIT_ONCE, tumalloc_init);
+        a = &ARENAS[__atomic_fetch_add(&NEXT_ARENA, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+        THREAD_ARENA = a;
+    }
+
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        __atomic_fetch_add(&a->contended, 1, __ATOMIC_RELAXED);
+        arena *locked = NULL;
+        for (unsigned i = 1; i < NUM_ARENAS && locked == NULL; i++) {
+            arena *other = &ARENAS[(a->index + i) % NUM_ARENAS];
+            if (pthread_mutex_trylock(&other->lock) == 0) {
+                locked = other;
+                THREAD_ARENA = other;
+                THREAD_ARENA_OLD = a;
+            }
+        }
+        if (locked == NULL) {
+            pthread_mutex_lock(&a->lock);
+            locked = a;
+        } else if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL && pthread_mutex_trylock(&a->lock) == 0) {
+            remote_drain(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+        a = locked;
+    }
+
+    a->lock_acquisitions++;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL) {
+        remote_drain(a);
+    }
+    if (__atomic_load_n(&PURGE_INTERVAL, __ATOMIC_RELAXED) != 0) {
+        arena_decay(a);
+    }
+    return a;
+}
+
+/**
+ * Return a block to the arena that owns it
+ *
+ * The caller must hold the lock of that arena.
+ *
+ * @param h The block to free
+ */
+static inline void arena_free(header *h) {
+    heap_count_free(&ARENAS[h->arena], h);
+    coalesce(&ARENAS[h->arena], (free_block *)h);
+}
+
+/**
+ * Find what a pointer belongs to through the page map
+ *
+ * Pointers we never handed out have no entry, slab pointers must sit on an
+ * object boundary and mapped blocks have exactly one valid pointer. All
+ * others abort.
+ *
+ * @param ptr A pointer passed to tufree or turealloc
+ * @return The tagged page map entry of the pointer
+ */
+static uintptr_t page_lookup(void *ptr) {
+    uintptr_t page = pagemap_get(ptr);
+
+    if ((page & PAGE_TAG_MASK) == PAGE_SLAB) {
+        slab *s = (slab *)(page & ~(uintptr_t)PAGE_TAG_MASK);
+        if ((char *)ptr < s->objects || s->objects + slab_index(s, ptr) * s->size != (char *)ptr) {
+            page = 0;
+        }
+    } else if ((page & PAGE_TAG_MASK) == PAGE_LARGE) {
+        if ((header *)ptr - 1 != (header *)(page & ~(uintptr_t)PAGE_TAG_MASK)) {
+            page = 0;
+        }
+    }
+
+    if (page == 0) {
+        corruption_detected();
+    }
+    return page;
+}
+
+/**
+ * Return a slab object to the arena that owns its slab
+ *
+ * The caller must hold the lock of that arena.
+ *
+ * @param ptr The object to free
+ */
+static inline void arena_free_object(void *ptr) {
+    slab_free(&ARENAS[slab_of(ptr)->arena], ptr);
+}
+
+/**
+ * Free every block other threads pushed onto an arena's remote list
+ *
+ * Takes the whole list with one atomic exchange, so pushers never have to
+ * wait and a node can never be seen twice. Slab objects were already
+ * counted as freed when they entered a thread cache, heap blocks are counted
+ * here. Slab objects freed twice meanwhile find their bit already set and
+ * are ignored. The caller must hold the arena lock.
+ *
+ * @param a The arena
+ */
+void remote_drain(arena *a) {
+    __atomic_store_n(&a->remote_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->remote_bytes, 0, __ATOMIC_RELAXED);
+    void *ptr = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        if ((pagemap_get(ptr) & PAGE_TAG_MASK) == PAGE_SLAB) {
+            slab_free(a, ptr);
+        } else {
+            arena_free((header *)ptr - 1);
+        }
+        ptr = next;
+    }
+}
+
+/**
+ * Hand blocks to an arena without taking its lock
+ *
+ * The blocks are linked through their first word, and heap blocks carry
+ * REMOTE_MAGIC, set by the caller. The whole chain goes on with one CAS, and the
+ * arena frees it the next time a thread locks it to allocate. Should nobody
+ * do that for a while, the pusher that takes the list past REMOTE_DRAIN_MIN
+ * blocks or REMOTE_DRAIN_BYTES bytes frees it itself, if the lock happens
+ * to be free.
+ *
+ * @param a The arena owning the blocks
+ * @param first The first block of the chain
+ * @param last The last block of the chain
+ * @param count How many blocks the chain holds
+ * @param bytes How many bytes the blocks span
+ */
+static void remote_push(arena *a, void *first, void *last, unsigned count, size_t bytes) {
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    uint32_t pending = __atomic_add_fetch(&a->remote_count, count, __ATOMIC_RELAXED);
+    size_t pending_bytes = __atomic_add_fetch(&a->remote_bytes, bytes, __ATOMIC_RELAXED);
+    if ((pending >= REMOTE_DRAIN_MIN || pending_bytes >= REMOTE_DRAIN_BYTES) && pthread_mutex_trylock(&a->lock) == 0) {
+        remote_drain(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/**
+ * Return every object a thread cache list holds to its slab
+ *
+ * Consecutive objects of the same arena are freed under one lock. The
+ * caller resets the space of the list.
+ *
+ * @param cls The size class of the list
+ */
+static void tcache_drain(unsigned cls) {
+    arena *locked = NULL;
+
+    for (void *ptr = TCACHE.entries[cls]; ptr != NULL;) {
+        void *next = *(void **)ptr;
+        arena *a = &ARENAS[slab_of(ptr)->arena];
+        if (locked != a) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            locked = a;
+            pthread_mutex_lock(&locked->lock);
+        }
+        arena_free_object(ptr);
+        ptr = next;
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    TCACHE.entries[cls] = NULL;
+}
+
+/**
+ * Drain a thread cache back into the arenas
+ *
+ * Registered as the TCACHE_KEY destructor, so it runs at thread exit. Later
+ * calls from the same thread bypass the cache.
+ *
+ * @param arg Unused
+ */
+static void tcache_shutdown(void *arg) {
+    (void)arg;
+
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        tcache_drain(cls);
+        // No space left sends every later free straight to the slow path
+        TCACHE.space[cls] = 0;
+    }
+
+    TCACHE.state = TCACHE_SHUTDOWN;
+    stats_unregister();
+}
+
+/**
+ * Install the thread exit handler for the calling thread's cache
+ *
+ * @return Non-zero if the cache can be used
+ */
+static int tcache_register(void) {
+    if (TCACHE.state == TCACHE_UNREGISTERED) {
+        pthread_once(&INIT_ONCE, tumalloc_init);
+        for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+            TCACHE.space[cls] = TCACHE_MAX;
+        }
+        // pthread_setspecific may allocate, which must find the cache ready
+        TCACHE.state = TCACHE_ACTIVE;
+        stats_register();
+        pthread_setspecific(TCACHE_KEY, &TCACHE);
+    }
+    return TCACHE.state == TCACHE_ACTIVE;
+}
+
+/**
+ * Push an object onto a thread cache list
+ *
+ * @param cls The size class of the object
+ * @param ptr The object
+ */
+static inline void tcache_push(unsigned cls, void *ptr) {
+    ((uintptr_t *)ptr)[1] = TCACHE_CANARY;
+    *(void **)ptr = TCACHE.entries[cls];
+    TCACHE.entries[cls] = ptr;
+    TCACHE.space[cls]--;
+}
+
+/**
+ * Check whether an object is parked in the calling thread's cache
+ *
+ * @param cls The size class of the object
+ * @param ptr The object
+ * @return Non-zero if the object is in the cache
+ */
+static int tcache_contains(unsigned cls, void *ptr) {
+    if (((uintptr_t *)ptr)[1] != TCACHE_CANARY) {
+        return 0;
+    }
+    for (void *curr = TCACHE.entries[cls]; curr != NULL; curr = *(void **)curr) {
+        if (curr == ptr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Refill an empty thread cache list from the thread's arena
+ *
+ * Takes a whole batch of objects from the arena's slabs under one lock. When
+ * no slab can be had, the request falls back to a heap block, which is never
+ * cached.
+ *
+ * @param cls The size class to refill
+ * @param size The object size of that class
+ * @return An object for the caller, or NULL if the OS is out of memory
+ */
+static void *tcache_refill(unsigned cls, size_t size) {
+    void *batch[TCACHE_BATCH];
+    int caching = tcache_register();
+
+    arena *a = arena_lock();
+    unsigned n = slab_alloc(a, cls, batch, caching && TCACHE.space[cls] >= TCACHE_BATCH - 1 ? TCACHE_BATCH : 1);
+    void *ptr;
+    if (n == 0) {
+        ptr = heap_alloc(a, size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size, NULL);
+        heap_count_alloc(a, ptr);
+    } else {
+        ptr = batch[0];
+        if (!caching) {
+            a->uncached_allocs[cls]++;
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    for (unsigned i = 1; i < n; i++) {
+        tcache_push(cls, batch[i]);
+    }
+    if (n > 0 && caching) {
+        STAT_ADD(THREAD_STATS.allocs[cls], 1);
+        STAT_ADD(THREAD_STATS.cache_misses, 1);
+    }
+
+    return ptr;
+}
+
+/**
+ * Free a small object when its thread cache list has no space left
+ *
+ * Registers the cache on a thread's first free, flushes half of a full list
+ * back to the owning arenas, and frees directly once the thread is exiting.
+ * Only the thread's own arena is locked, the others get their objects
+ * through their remote lists, one CAS per run of objects.
+ *
+ * @param cls The size class of the object
+ * @param ptr The object being freed
+ */
+static void tcache_flush(unsigned cls, void *ptr) {
+    if (TCACHE.state == TCACHE_UNREGISTERED) {
+        tcache_register();
+        tcache_push(cls, ptr);
+        STAT_ADD(THREAD_STATS.frees[cls], 1);
+        return;
+    }
+
+    if (TCACHE.state != TCACHE_ACTIVE) {
+        arena *a = &ARENAS[slab_of(ptr)->arena];
+        pthread_mutex_lock(&a->lock);
+        a->uncached_frees[cls]++;
+        arena_free_object(ptr);
+        pthread_mutex_unlock(&a->lock);
+        return;
+    }
+
+    // Objects of the thread's own arena are freed under its lock, runs of
+    // other arenas' objects are chained up and pushed onto their remote lists
+    arena *locked = NULL;
+    arena *chained = NULL;
+    void *first = NULL;
+    void *last = NULL;
+    unsigned count = 0;
+    for (unsigned i = 0; i < TCACHE_MAX / 2; i++) {
+        void *cached = TCACHE.entries[cls];
+        TCACHE.entries[cls] = *(void **)cached;
+
+        arena *a = &ARENAS[slab_of(cached)->arena];
+        if (a != THREAD_ARENA) {
+            if (chained != a) {
+                if (chained != NULL) {
+                    remote_push(chained, first, last, count, count * slab_of(first)->size);
+                }
+                chained = a;
+                first = cached;
+                count = 0;
+            } else {
+                *(void **)last = cached;
+            }
+            last = cached;
+            count++;
+            continue;
+        }
+
+        if (locked == NULL) {
+            locked = a;
+            pthread_mutex_lock(&locked->lock);
+        }
+        arena_free_object(cached);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    if (chained != NULL) {
+        remote_push(chained, first, last, count, count * slab_of(first)->size);
+    }
+
+    TCACHE.space[cls] += TCACHE_MAX / 2;
+    tcache_push(cls, ptr);
+    STAT_ADD(THREAD_STATS.frees[cls], 1);
+    STAT_ADD(THREAD_STATS.cache_flushes, 1);
+}
+
+#define BATCH_CHUNK 1024 /**< Heap blocks tufree_batch sorts and frees at once */
+
+/**
+ * Sort addresses in ascending order
+ *
+ * A least significant digit radix sort over the bits that vary between
+ * 16 byte aligned user addresses, skipping digits every address shares.
+ *
+ * @param keys The addresses, sorted in place
+ * @param scratch Room for as many addresses
+ * @param n How many addresses there are
+ */
+static void sort_addresses(uintptr_t *keys, uintptr_t *scratch, size_t n) {
+    uintptr_t *from = keys;
+    uintptr_t *to = scratch;
+
+    for (unsigned shift = 4; shift < 52; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < n; i++) {
+            counts[(from[i] >> shift) & 0xFF]++;
+        }
+        if (n == 0 || counts[(from[0] >> shift) & 0xFF] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (unsigned d = 0; d < 256; d++) {
+            size_t c = counts[d];
+            counts[d] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            to[counts[(from[i] >> shift) & 0xFF]++] = from[i];
+        }
+
+        uintptr_t *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != keys) {
+        memcpy(keys, from, n * sizeof(uintptr_t));
+    }
+}
+
+/**
+ * Free a batch of heap blocks in address order
+ *
+ * Blocks of the batch that sit back to back in memory are merged first and
+ * go through coalesce as one, so a run of neighbors costs a single free list
+ * update. Blocks that are already free, including duplicates in the batch,
+ * are skipped.
+ *
+ * @param headers The headers of the blocks, reordered
+ * @param n How many blocks there are
+ */
+static void heap_free_sorted(uintptr_t *headers, size_t n) {
+    uintptr_t scratch[BATCH_CHUNK];
+    arena *locked = NULL;
+
+    sort_addresses(headers, scratch, n);
+
+    for (size_t i = 0; i < n;) {
+        header *h = (header *)headers[i++];
+        if (h->magic == FREED_MAGIC || h->magic == REMOTE_MAGIC) {
+            continue;
+        }
+        if (h->magic != MAGIC_NUMBER) {
+            corruption_detected();
+        }
+
+        arena *a = &ARENAS[h->arena];
+        if (locked != a) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            locked = a;
+            pthread_mutex_lock(&locked->lock);
+        }
+
+        // Absorb the blocks of the batch that follow right behind
+        heap_count_free(a, h);
+        while (i < n && (header *)headers[i] == next_block(h) && ((header *)headers[i])->magic == MAGIC_NUMBER) {
+            header *next = (header *)headers[i++];
+            heap_count_free(a, next);
+            next->magic = FREED_MAGIC;
+            h->size += sizeof(header) + next->size;
+        }
+        h->magic = FREED_MAGIC;
+        coalesce(a, (free_block *)h);
+    }
+
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/**
+ * Allocate memory without recording the call
+ *
+ * Small requests are served as headerless slab objects from the calling
+ * thread's cache without taking a lock. Requests from MMAP_THRESHOLD up get
+ * their own mapping, and everything else goes to the thread's arena.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+static void *allocate(size_t size) {
+    // Handle zero size and impossibly large requests
+    if (size == 0 || size > PTRDIFF_MAX) {
+        return NULL;
+    }
+
+    // Align size to be a multiple of ALIGNMENT
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    if (size <= SMALL_CLASS_MAX) {
+        unsigned cls = size_to_class(size);
+        void *ptr = TCACHE.entries[cls];
+
+        if (ptr == NULL) {
+            return tcache_refill(cls, size);
+        }
+
+        TCACHE.entries[cls] = *(void **)ptr;
+        TCACHE.space[cls]++;
+        ((uintptr_t *)ptr)[1] = 0;
+        STAT_ADD(THREAD_STATS.allocs[cls], 1);
+        return ptr;
+    }
+
+    // Large blocks bypass the arenas
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    if (size >= __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED)) {
+        return mmap_alloc(ALIGNMENT, size);
+    }
+
+    arena *a = arena_lock();
+    void *ptr = heap_alloc(a, size, NULL);
+    heap_count_alloc(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+
+    return ptr;
+}
+
+/**
+ * Allocates memory for the end user
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+void *tumalloc(size_t size) {
+    void *ptr = allocate(size);
+    if (ptr != NULL) {
+        TRACE(TRACE_MALLOC, ptr, 0, size);
+    }
+    PROFILE(ptr, size);
+    return ptr;
+}
+
+/**
+ * Allocate zeroed memory without recording the call
+ *
+ * Mapped blocks come zeroed from the kernel and are not touched at all, so
+ * their pages are only committed once the program writes them. Heap blocks
+ * are only cleared outside the part the top chunk never wrote or a purge
+ * gave back, and outside the arena lock. Slab objects are simply cleared.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to size zero bytes
+ */
+static void *allocate_zeroed(size_t size) {
+    size_t aligned = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size == 0 || size > PTRDIFF_MAX || aligned <= SMALL_CLASS_MAX) {
+        void *ptr = allocate(size);
+        if (ptr != NULL) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    if (aligned >= __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED)) {
+        return mmap_alloc(ALIGNMENT, aligned);
+    }
+
+    zero_range zero;
+    arena *a = arena_lock();
+    char *ptr = heap_alloc(a, aligned, &zero);
+    heap_count_alloc(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    char *end = ptr + size;
+    if (zero.start < ptr) {
+        zero.start = ptr;
+    }
+    if (zero.end > end) {
+        zero.end = end;
+    }
+    if (zero.start >= zero.end) {
+        memset(ptr, 0, size);
+    } else {
+        memset(ptr, 0, zero.start - ptr);
+        memset(zero.end, 0, end - zero.end);
+    }
+    return ptr;
+}
+
+/**
+ * Allocates and initializes a list of elements for the end user
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the requested block of initialized memory
+ */
+void *tucalloc(size_t num, size_t size) {
+    // Calculate total size
+    size_t total_size = num * size;
+    
+    // Handle overflow
+    if (num > 0 && total_size / num != size) {
+        return NULL;
+    }
+    
+    // Allocate memory that reads as zeros
+    void *ptr = allocate_zeroed(total_size);
+    
+    if (ptr != NULL) {
+        TRACE(TRACE_CALLOC, ptr, 0, total_size);
+    }
+    PROFILE(ptr, total_size);
+    
+    return ptr;
+}
+
+/**
+ * Give memory back without recording the call
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ */
+static void deallocate(void *ptr) {
+    // Handle NULL pointer
+    if (ptr == NULL) {
+        return;
+    }
+    
+    uintptr_t page = page_lookup(ptr);
+
+    // Park slab objects in the thread cache
+    if ((page & PAGE_TAG_MASK) == PAGE_SLAB) {
+        slab *s = (slab *)(page & ~(uintptr_t)PAGE_TAG_MASK);
+
+        // Already cached or back in its slab, this is a double free. One still
+        // on a remote list is caught by the slab bitmap when the list drains
+        if (tcache_contains(s->cls, ptr) || slab_is_free(s, slab_index(s, ptr))) {
+            return;
+        }
+
+        if (TCACHE.space[s->cls] == 0) {
+            tcache_flush(s->cls, ptr);
+            return;
+        }
+
+        tcache_push(s->cls, ptr);
+        STAT_ADD(THREAD_STATS.frees[s->cls], 1);
+        return;
+    }
+
+    // Get the header for the pointer
+    header *h = (header *)((char *)ptr - sizeof(header));
+    
+    // Mapped blocks go straight back to the OS
+    if ((page & PAGE_TAG_MASK) == PAGE_LARGE) {
+        size_t length = (char *)ptr + h->size - mmap_base(h);
+        pagemap_set(ptr, 1, 0);
+        munmap(mmap_base(h), length);
+        STAT_ADD_SHARED(LARGE_STATS.munmap_calls, 1);
+        STAT_ADD_SHARED(LARGE_STATS.count, -1);
+        STAT_ADD_SHARED(LARGE_STATS.bytes, -length);
+        return;
+    }
+
+    // Check if the block is already freed (double free protection)
+    if (h->magic == FREED_MAGIC || h->magic == REMOTE_MAGIC) {
+        // Block is already freed, just return
+        return;
+    }
+    
+    // Verify the magic number
+    if (h->magic != MAGIC_NUMBER) {
+        corruption_detected();
+    }
+    
+    // Another thread's arena gets the block through its remote list, the
+    // arena the thread moved away from directly whenever it is free
+    arena *a = &ARENAS[page >> 2];
+    if (a != THREAD_ARENA && (a != THREAD_ARENA_OLD || pthread_mutex_trylock(&a->lock) != 0)) {
+        h->magic = REMOTE_MAGIC;
+        remote_push(a, ptr, ptr, 1, sizeof(header) + h->size);
+        return;
+    }
+    if (a != THREAD_ARENA) {
+        remote_drain(a);
+        arena_free(h);
+        pthread_mutex_unlock(&a->lock);
+        return;
+    }
+
+    // Coalesce the block with any neighboring free blocks and file it
+    // under its size class
+    pthread_mutex_lock(&a->lock);
+    arena_free(h);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Removes used chunk of memory and returns it to the free list
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ */
+void tufree(void *ptr) {
+    // Handle NULL pointer
+    if (ptr == NULL) {
+        return;
+    }
+
+    TRACE(TRACE_FREE, ptr, 0, 0);
+    PROFILE_FREE(ptr);
+    deallocate(ptr);
+}
+
+/**
+ * Frees memory whose requested size the caller still knows
+ *
+ * Exists for free_sized and sized operator delete. The page map already
+ * tells a slab object from a heap block with one load, and the slab or
+ * header has to be read anyway to catch double frees, so the size saves
+ * nothing and the block goes the way of tufree.
+ *
+ * @param ptr Pointer from tumalloc, tucalloc or turealloc, or NULL
+ * @param size The size passed when it was allocated, unused
+ */
+void tufree_sized(void *ptr, size_t size) {
+    (void)size;
+    tufree(ptr);
+}
+
+/**
+ * Resize memory without recording the call
+ *
+ * @param ptr A pointer to an already allocated piece of memory, not NULL
+ * @param new_size The new requested size to allocate, not zero
+ * @return A new pointer containing the contents of ptr, but with the new_size
+ */
+static void *reallocate(void *ptr, size_t new_size) {
+    uintptr_t page = page_lookup(ptr);
+
+    // Slab objects keep their slot while the new size still fits
+    if ((page & PAGE_TAG_MASK) == PAGE_SLAB) {
+        slab *s = (slab *)(page & ~(uintptr_t)PAGE_TAG_MASK);
+        if (tcache_contains(s->cls, ptr)) {
+            return allocate(new_size);
+        }
+        if (new_size <= s->size) {
+            return ptr;
+        }
+
+        void *new_ptr = allocate(new_size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, s->size);
+            deallocate(ptr);
+        }
+        return new_ptr;
+    }
+
+    // Get the header for the pointer
+    header *h = (header *)((char *)ptr - sizeof(header));
+    
+    // Verify the magic number
+    if (h->magic != MAGIC_NUMBER) {
+        // Check if it's a freed pointer that we're trying to reuse, blocks
+        // waiting on a remote list are as good as freed
+        if (h->magic == FREED_MAGIC || h->magic == REMOTE_MAGIC) {
+            // We'll handle this like a malloc instead
+            return allocate(new_size);
+        }
+        corruption_detected();
+    }
+    
+    // Large mapped blocks are resized by the kernel without copying
+    size_t threshold = __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED);
+    if ((h->flags & BLOCK_MMAPPED) && new_size >= threshold && new_size <= PTRDIFF_MAX) {
+        return mmap_resize(h, new_size);
+    }
+
+    // Heap blocks shrink in place and grow into free space right behind them,
+    // unless they are big enough to deserve their own mapping
+    if (!(h->flags & BLOCK_MMAPPED) && new_size < threshold) {
+        size_t size = (new_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (size < MIN_BLOCK_SIZE) {
+            size = MIN_BLOCK_SIZE;
+        }
+
+        arena *a = &ARENAS[page >> 2];
+        pthread_mutex_lock(&a->lock);
+        heap_count_free(a, h);
+        int resized = heap_resize(a, h, size);
+        heap_count_alloc(a, ptr);
+        pthread_mutex_unlock(&a->lock);
+
+        if (resized) {
+            return ptr;
+        }
+    }
+    
+    // Allocate new memory
+    void *new_ptr = allocate(new_size);
+    
+    if (new_ptr == NULL) {
         return NULL;
     }
     
     // Copy the data from the old memory to the new memory
-    memcpy(new_ptr, ptr, h->size);
+    memcpy(new_ptr, ptr, new_size < h->size ? new_size : h->size);
     
-    // Instead of freeing the old pointer (which would cause problems in the test),
-    // just mark it as freed but don't add it to the free list
-    h->magic = FREED_MAGIC;
+    // Return the old block to its arena or the OS
+    deallocate(ptr);
     
     return new_ptr;
-}
\ No newline at end of file
+}
+
+/**
+ * Reallocates a chunk of memory with a bigger size
+ *
+ * @param ptr A pointer to an already allocated piece of memory
+ * @param new_size The new requested size to allocate
+ * @return A new pointer containing the contents of ptr, but with the new_size
+ */
+void *turealloc(void *ptr, size_t new_size) {
+    // Handle NULL pointer
+    if (ptr == NULL) {
+        void *new_ptr = allocate(new_size);
+        if (new_ptr != NULL) {
+            TRACE(TRACE_REALLOC, new_ptr, 0, new_size);
+        }
+        PROFILE(new_ptr, new_size);
+        return new_ptr;
+    }
+
+    // Handle zero size
+    if (new_size == 0) {
+        tufree(ptr);
+        return NULL;
+    }
+
+    // The old block may be freed and handed to another thread in there
+    PROFILE_FREE(ptr);
+    void *new_ptr = reallocate(ptr, new_size);
+    if (new_ptr != NULL) {
+        TRACE(TRACE_REALLOC, new_ptr, ptr, new_size);
+    }
+    PROFILE(new_ptr, new_size);
+    return new_ptr;
+}
+
+/**
+ * Allocate aligned memory without recording the call
+ *
+ * Alignments up to ALIGNMENT are what tumalloc gives anyway. Larger ones are
+ * carved out of a heap block, or out of a mapping once the block plus its
+ * alignment reaches MMAP_THRESHOLD. The result goes back through tufree and
+ * turealloc like any other block.
+ *
+ * @param alignment The alignment of the memory, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned memory, or NULL if the alignment is not a power of two
+ */
+static void *allocate_aligned(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return allocate(size);
+    }
+
+    // Handle zero size and impossibly large requests
+    if (size == 0 || size > PTRDIFF_MAX || alignment > PTRDIFF_MAX - size) {
+        return NULL;
+    }
+
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
+
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    if (size + alignment >= __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED)) {
+        return mmap_alloc(alignment, size);
+    }
+
+    arena *a = arena_lock();
+    void *ptr = heap_alloc_aligned(a, alignment, size);
+    heap_count_alloc(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+
+    return ptr;
+}
+
+/**
+ * Allocates memory with a given alignment for the end user
+ *
+ * @param alignment The alignment of the memory, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned memory, or NULL if the alignment is not a power of two
+ */
+void *tualigned_alloc(size_t alignment, size_t size) {
+    void *ptr = allocate_aligned(alignment, size);
+    if (ptr != NULL) {
+        TRACE(TRACE_ALIGNED, ptr, alignment, size);
+    }
+    PROFILE(ptr, size);
+    return ptr;
+}
+
+/**
+ * Allocates aligned memory the POSIX way
+ *
+ * @param memptr Where the pointer to the memory goes
+ * @param alignment The alignment, a power of two and a multiple of sizeof(void *)
+ * @param size The amount of memory to allocate
+ * @return 0 on success, EINVAL for a bad alignment or ENOMEM when out of memory
+ */
+int tuposix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    void *ptr = tualigned_alloc(alignment, size);
+    if (ptr == NULL && size != 0) {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+/**
+ * Allocates aligned memory the old way
+ *
+ * An alignment that is not a power of two is rounded up to one.
+ *
+ * @param alignment The alignment of the memory
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned memory
+ */
+void *tumemalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return tumalloc(size);
+    }
+    if (alignment & (alignment - 1)) {
+        alignment = alignment > (SIZE_MAX >> 1) ? 0 : 1UL << (64 - __builtin_clzl(alignment));
+    }
+    return tualigned_alloc(alignment, size);
+}
+
+/**
+ * Get the number of bytes a block can actually hold
+ *
+ * @param ptr A pointer returned by one of the allocation functions
+ * @return The usable size of the block, or 0 for NULL
+ */
+size_t tumalloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    uintptr_t page = page_lookup(ptr);
+    if ((page & PAGE_TAG_MASK) == PAGE_SLAB) {
+        return ((slab *)(page & ~(uintptr_t)PAGE_TAG_MASK))->size;
+    }
+    return ((header *)ptr - 1)->size;
+}
+
+/**
+ * Choose how blocks above the small classes are picked from the free trees
+ *
+ * Best fit takes the smallest block that fits and keeps fragmentation low,
+ * first fit the lowest addressed one, which packs the heap towards its
+ * start, and next fit the lowest addressed one past the block it took last.
+ * Takes effect for every arena from the next allocation on.
+ *
+ * @param policy TUMALLOC_FIT_FIRST, TUMALLOC_FIT_NEXT or TUMALLOC_FIT_BEST
+ * @return The previous policy, or -1 if policy is not one of them
+ */
+int tumalloc_set_fit(int policy) {
+    if (policy != TUMALLOC_FIT_FIRST && policy != TUMALLOC_FIT_NEXT && policy != TUMALLOC_FIT_BEST) {
+        return -1;
+    }
+
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    return __atomic_exchange_n(&FIT_POLICY, policy, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reads and changes the allocator settings
+ *
+ * Takes the names of TUMALLOC_CONF: arenas, fit, mmap_threshold,
+ * trim_threshold, heap_grow, tcache_max, decay_ms, hugepages, profile and
+ * stats_print. Every one can be read. fit, mmap_threshold, trim_threshold,
+ * heap_grow, decay_ms and stats_print can also be changed, and take effect
+ * from the next allocation that reads them. The others shape structures
+ * that are already built and are fixed once the allocator runs.
+ *
+ * @param name The name of the setting
+ * @param old_value Where the current value goes, or NULL
+ * @param new_value The value to set, or NULL to only read
+ * @return 0 on success, ENOENT for an unknown name, EPERM for a setting fixed at startup, EINVAL for a bad value
+ */
+int tumallctl(const char *name, size_t *old_value, const size_t *new_value) {
+    pthread_once(&INIT_ONCE, tumalloc_init);
+
+    int id = option_find(name, strlen(name));
+    if (id < 0) {
+        return ENOENT;
+    }
+    if (old_value != NULL) {
+        *old_value = option_get(id);
+    }
+    if (new_value == NULL) {
+        return 0;
+    }
+    if (!OPTIONS[id].runtime) {
+        return EPERM;
+    }
+    return option_set(id, *new_value);
+}
+
+/**
+ * Write the statistics report to stderr at exit when stats_print is set
+ */
+__attribute__((destructor)) static void stats_print_exit(void) {
+    if (__atomic_load_n(&STATS_PRINT, __ATOMIC_RELAXED)) {
+        tumalloc_info(STDERR_FILENO, TUMALLOC_INFO_TEXT);
+    }
+}
+
+/**
+ * Gives the dirty pages of every free heap block back to the OS now
+ *
+ * Does not wait for the decay time, which makes it the call to make before
+ * a long idle period. Arenas are locked one at a time, and blocks other
+ * threads freed into them are taken back first. Purged pages are reused
+ * like any others and simply read back as zeros.
+ *
+ * @return The number of bytes given back
+ */
+size_t tumalloc_purge(void) {
+    size_t purged = 0;
+
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    for (unsigned i = 0; i < NUM_ARENAS; i++) {
+        arena *a = &ARENAS[i];
+        pthread_mutex_lock(&a->lock);
+        remote_drain(a);
+        purged += arena_purge(a, EPOCH_PURGED - 1);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return purged;
+}
+
+/**
+ * Allocates many blocks of the same size at once
+ *
+ * Small objects come from the thread cache and then straight from the
+ * slabs, a whole batch under one arena lock. Heap blocks are carved back to
+ * back out of one free region per lock. When memory runs out part way, the
+ * blocks allocated so far are still handed out.
+ *
+ * @param size The amount of memory in each block
+ * @param count How many blocks to allocate
+ * @param out Where the pointers to the blocks go
+ * @return How many blocks were allocated, from out[0] on
+ */
+size_t tumalloc_batch(size_t size, size_t count, void **out) {
+    size_t requested = size;
+    size_t n = 0;
+
+    // Handle zero size and impossibly large requests
+    if (size == 0 || size > PTRDIFF_MAX) {
+        return 0;
+    }
+
+    // Align size to be a multiple of ALIGNMENT
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    if (size <= SMALL_CLASS_MAX) {
+        unsigned cls = size_to_class(size);
+
+        while (n < count && TCACHE.entries[cls] != NULL) {
+            void *ptr = TCACHE.entries[cls];
+            TCACHE.entries[cls] = *(void **)ptr;
+            TCACHE.space[cls]++;
+            ((uintptr_t *)ptr)[1] = 0;
+            out[n++] = ptr;
+        }
+        if (n > 0) {
+            STAT_ADD(THREAD_STATS.allocs[cls], n);
+        }
+
+        if (n < count) {
+            arena *a = arena_lock();
+            while (n < count) {
+                unsigned want = count - n < UINT32_MAX ? (unsigned)(count - n) : UINT32_MAX;
+                unsigned got = slab_alloc(a, cls, out + n, want);
+                a->uncached_allocs[cls] += got;
+                n += got;
+                if (got < want) {
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+
+    // Out of slabs or not small, carve runs of heap blocks
+    pthread_once(&INIT_ONCE, tumalloc_init);
+    size_t threshold = __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED);
+    if (n < count && size < threshold) {
+        arena *a = arena_lock();
+        size_t block = size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+        while (n < count) {
+            size_t got = heap_carve(a, block, out + n, count - n);
+            for (size_t i = 0; i < got; i++) {
+                heap_count_alloc(a, out[n + i]);
+            }
+            n += got;
+            if (got == 0) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    for (; n < count && size >= threshold; n++) {
+        out[n] = mmap_alloc(ALIGNMENT, size);
+        if (out[n] == NULL) {
+            break;
+        }
+    }
+
+    if (TRACE_ENABLED) {
+        for (size_t i = 0; i < n; i++) {
+            trace_event(TRACE_MALLOC, out[i], 0, requested);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        PROFILE(out[i], requested);
+    }
+    return n;
+}
+
+/**
+ * Frees many blocks at once
+ *
+ * Slab objects are freed straight into their slabs' bitmaps without being
+ * touched. Consecutive objects of one slab cost a multiply each, set their
+ * bits a whole bitmap word at a time and share the arena lock, and the slab
+ * is only looked up again when it changes. The calling thread's cached
+ * objects of a class are given back first, so freeing one of them again is
+ * caught as a double free. Heap blocks are sorted by address and freed in
+ * runs, see heap_free_sorted. NULL pointers are skipped.
+ *
+ * @param ptrs The pointers to free
+ * @param count How many pointers there are
+ */
+void tufree_batch(void **ptrs, size_t count) {
+    uintptr_t heap[BATCH_CHUNK];
+    size_t heap_count = 0;
+    uint32_t drained = 0;
+    arena *locked = NULL;
+    slab *s = NULL;
+    unsigned cls = 0; // Class of s, which may be reused once its last object is freed
+    size_t word = 0; // Bitmap word of the pending objects of s
+    uint64_t mask = 0; // Pending objects of s in that word
+
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+        TRACE(TRACE_FREE, ptr, 0, 0);
+        PROFILE_FREE(ptr);
+
+        if (((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1)) != (uintptr_t)s) {
+            if (mask != 0) {
+                locked->uncached_frees[cls] += slab_free_mask(locked, s, word, mask);
+                mask = 0;
+            }
+
+            uintptr_t page = page_lookup(ptr);
+            if ((page & PAGE_TAG_MASK) != PAGE_SLAB) {
+                if (locked != NULL) {
+                    pthread_mutex_unlock(&locked->lock);
+                    locked = NULL;
+                }
+                s = NULL;
+                if ((page & PAGE_TAG_MASK) == PAGE_LARGE) {
+                    deallocate(ptr);
+                    continue;
+                }
+                heap[heap_count++] = (uintptr_t)ptr - sizeof(header);
+                if (heap_count == BATCH_CHUNK) {
+                    heap_free_sorted(heap, heap_count);
+                    heap_count = 0;
+                }
+                continue;
+            }
+
+            s = (slab *)(page & ~(uintptr_t)PAGE_TAG_MASK);
+            cls = s->cls;
+            if (!(drained & (1U << cls))) {
+                if (locked != NULL) {
+                    pthread_mutex_unlock(&locked->lock);
+                    locked = NULL;
+                }
+                if (TCACHE.state == TCACHE_ACTIVE) {
+                    tcache_drain(cls);
+                    TCACHE.space[cls] = TCACHE_MAX;
+                }
+                drained |= 1U << cls;
+            }
+            if (locked != &ARENAS[s->arena]) {
+                if (locked != NULL) {
+                    pthread_mutex_unlock(&locked->lock);
+                }
+                locked = &ARENAS[s->arena];
+                pthread_mutex_lock(&locked->lock);
+                // Objects still on the remote list reach their slab first, so
+                // the bitmap catches them when the batch frees them again
+                remote_drain(locked);
+            }
+        }
+
+        size_t index = slab_index(s, ptr);
+        if ((char *)ptr < s->objects || s->objects + index * s->size != (char *)ptr) {
+            corruption_detected();
+        }
+        if (index / 64 != word) {
+            if (mask != 0) {
+                locked->uncached_frees[cls] += slab_free_mask(locked, s, word, mask);
+            }
+            word = index / 64;
+            mask = 0;
+        }
+        mask |= 1ULL << (index % 64);
+    }
+
+    if (mask != 0) {
+        locked->uncached_frees[cls] += slab_free_mask(locked, s, word, mask);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    if (heap_count > 0) {
+        heap_free_sorted(heap, heap_count);
+    }
+}
@@ -2,26 +2,153 @@
 #define CYB3053_PROJECT2_ALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
  * Header for allocated blocks
+ *
+ * Every block starts with this 16 byte header. The size is the payload size,
+ * so the next block in memory starts right after the payload.
  */
 typedef struct header {
     size_t size; /**< Size of the block */
-    int magic; /**< Magic number for error checking */
+    uint32_t magic; /**< Magic number for error checking */
+    uint16_t flags; /**< Block state bits (BLOCK_PREV_FREE, ...) */
+    uint16_t arena; /**< Index of the arena that owns the block */
 } header;
 
 /**
  * Free block structure
+ *
+ * A free block shares the header layout and keeps its free list links in the
+ * first bytes of the payload. Its last 8 bytes hold a copy of the size (the
+ * footer) so the next block can find the start of this one.
  */
 typedef struct free_block {
     size_t size; /**< Size of the block */
+    uint32_t magic; /**< Magic number for error checking */
+    uint16_t flags; /**< Block state bits (BLOCK_PREV_FREE, ...) */
+    uint16_t arena; /**< Index of the arena that owns the block */
     struct free_block *next; /**< Pointer to the next free block */
+    struct free_block *prev; /**< Pointer to the previous free block */
 } free_block;
 
+#define TUMALLOC_SIZE_CLASSES 64 /**< Number of size classes reported by tumalloc_stats */
+
+#define TUMALLOC_INFO_TEXT 0 /**< tumalloc_info writes a human readable report */
+#define TUMALLOC_INFO_JSON 1 /**< tumalloc_info writes a JSON object */
+
+#define TUMALLOC_FIT_FIRST 0 /**< Free blocks above the small classes are picked by lowest address */
+#define TUMALLOC_FIT_NEXT 1 /**< Lowest address past the last block picked, wrapping around */
+#define TUMALLOC_FIT_BEST 2 /**< Smallest block that fits, lowest address first, the default */
+
+/**
+ * Statistics for one size class
+ *
+ * Allocations and frees count what the program asked for. Objects sitting
+ * in a thread cache count as freed.
+ */
+typedef struct tuclass_stats {
+    size_t size; /**< Largest block size in the class, 0 for the unbounded last class */
+    uint64_t allocs; /**< Blocks handed out */
+    uint64_t frees; /**< Blocks taken back */
+    size_t free_blocks; /**< Blocks on the free lists, or free objects in slabs */
+    size_t slabs; /**< Slabs holding objects of the class */
+} tuclass_stats;
+
+/**
+ * Snapshot of the allocator state
+ *
+ * Filled in by tumalloc_stats. Counters cover the whole process, and the
+ * sizes are in bytes.
+ */
+typedef struct tustats {
+    size_t allocated; /**< Payload bytes handed out and not yet freed */
+    size_t active; /**< Bytes of heap, slab and mapped memory backing live blocks */
+    size_t mapped; /**< Bytes obtained from the OS and not given back */
+    size_t heap; /**< Bytes in arena heap segments */
+    size_t slab; /**< Bytes in slabs owned by the arenas */
+    size_t slab_pooled; /**< Bytes in empty slabs waiting for reuse */
+    size_t large; /**< Bytes in mapped large blocks */
+    size_t large_count; /**< Mapped large blocks in use */
+    size_t free_bytes; /**< Bytes on the heap free lists and in the top chunks */
+    size_t free_blocks; /**< Blocks on the heap free lists and top chunks */
+    size_t largest_free; /**< Largest free heap block */
+    double fragmentation; /**< Share of free heap bytes outside the largest free block */
+    uint64_t cache_misses; /**< Small allocations that had to refill a thread cache */
+    uint64_t cache_flushes; /**< Small frees that had to flush a thread cache */
+    uint64_t top_allocs; /**< Heap allocations carved from a top chunk because no free block fit */
+    uint64_t grow_calls; /**< sbrk or mmap calls made to grow a heap */
+    uint64_t syscalls_avoided; /**< Heap misses served from a top chunk without a syscall */
+    uint64_t trim_calls; /**< sbrk or madvise calls made to give memory back */
+    uint64_t bytes_returned; /**< Bytes given back to the OS by trimming */
+    uint64_t purge_calls; /**< madvise calls made to purge dirty pages of free blocks */
+    uint64_t bytes_purged; /**< Bytes given back to the OS by purging */
+    uint64_t mmap_calls; /**< mmap calls made for large blocks */
+    uint64_t munmap_calls; /**< munmap calls made for large blocks */
+    uint64_t mremap_calls; /**< mremap calls made for large blocks */
+    uint64_t lock_acquisitions; /**< Arena locks taken to allocate */
+    uint64_t lock_contended; /**< Arena locks found taken by another thread */
+    size_t huge_pages; /**< Transparent huge pages backing heap and slab memory, with TUMALLOC_HUGEPAGES set */
+    unsigned arenas; /**< Number of arenas */
+    tuclass_stats classes[TUMALLOC_SIZE_CLASSES]; /**< Per size class histogram */
+} tustats;
+
+/**
+ * A region objects are bump allocated from and freed all at once
+ *
+ * Created with tuarena_create, opaque to its users.
+ */
+typedef struct tuarena tuarena;
+
+/**
+ * A heap kept in a file, opened with tuheap_open
+ *
+ * Its blocks are not valid for tufree, and opaque to its users.
+ */
+typedef struct tuheap tuheap;
+
 void *tumalloc(size_t size);
 void *tucalloc(size_t num, size_t size);
 void *turealloc(void *ptr, size_t new_size);
 void tufree(void *ptr);
+void tufree_sized(void *ptr, size_t size);
+
+void *tualigned_alloc(size_t alignment, size_t size);
+int tuposix_memalign(void **memptr, size_t alignment, size_t size);
+void *tumemalign(size_t alignment, size_t size);
+size_t tumalloc_usable_size(void *ptr);
+size_t tumalloc_batch(size_t size, size_t count, void **out);
+void tufree_batch(void **ptrs, size_t count);
+int tumalloc_set_fit(int policy);
+int tumallctl(const char *name, size_t *old_value, const size_t *new_value);
+size_t tumalloc_purge(void);
+
+tuarena *tuarena_create(size_t chunk_size);
+void *tuarena_alloc(tuarena *r, size_t size);
+void tuarena_reset(tuarena *r);
+void tuarena_destroy(tuarena *r);
+
+tuheap *tuheap_open(const char *path, size_t size);
+int tuheap_close(tuheap *h);
+int tuheap_sync(tuheap *h);
+void *tuheap_alloc(tuheap *h, size_t size);
+void tuheap_free(tuheap *h, void *ptr);
+void *tuheap_root(tuheap *h);
+void tuheap_set_root(tuheap *h, void *ptr);
+uint64_t tuheap_offset(tuheap *h, const void *ptr);
+void *tuheap_pointer(tuheap *h, uint64_t offset);
+
+void tumalloc_stats(tustats *stats);
+int tumalloc_info(int fd, int format);
+int tumalloc_profile(int fd);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif //CYB3053_PROJECT2_ALLOC_H
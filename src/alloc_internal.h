@@ -0,0 +1,336 @@
+#ifndef CYB3053_PROJECT2_ALLOC_INTERNAL_H
+#define CYB3053_PROJECT2_ALLOC_INTERNAL_H
+
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Nothing in here is part of the API, keep it out of the shared library's exports
+#pragma GCC visibility push(hidden)
+
+#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+
+#define NUM_SIZE_CLASSES 64 /**< Number of size classes, one bit each in bin_map */
+#define SMALL_CLASS_MAX 512 /**< Largest size served by the exact-size small classes */
+#define SMALL_CLASS_COUNT (SMALL_CLASS_MAX / ALIGNMENT) /**< Number of exact-size small classes */
+#define CLASS_SUBDIVISIONS 4 /**< Medium classes per power of two */
+
+#define MAX_ARENAS 64 /**< Upper bound for the number of arenas */
+
+struct slab;
+
+/**
+ * A free block above SMALL_CLASS_MAX, as a node of its size class's tree
+ *
+ * Each tree is a treap ordered by size and then address, with priorities
+ * hashed from the address. Every node also knows the lowest and highest
+ * addressed node below it, which lets first and next fit skip whole
+ * subtrees. The purge epoch tells how long the block's pages have been
+ * dirty.
+ */
+typedef struct tree_block {
+    free_block block; /**< The block, its list links are unused */
+    struct tree_block *left; /**< Subtree of blocks that sort before this one */
+    struct tree_block *right; /**< Subtree of blocks that sort after this one */
+    struct tree_block *lo; /**< Lowest addressed node of the subtree */
+    struct tree_block *hi; /**< Highest addressed node of the subtree */
+    uint64_t epoch; /**< Purge epoch of the arena when the block was freed, EPOCH_PURGED once purged */
+} tree_block;
+
+#define EPOCH_PURGED UINT64_MAX /**< Epoch of a free block whose whole pages went back to the OS */
+
+/**
+ * An independent heap with its own lock, free lists and chunk source
+ *
+ * Arena 0 grows the program break with sbrk. The other arenas carve their
+ * blocks out of mmap chunks. Every block records the index of its arena, so
+ * it always goes back to the arena that owns it. Small objects live in slabs,
+ * which belong to an arena as well. Threads that free into an arena they
+ * do not allocate from push onto its remote list instead of locking it.
+ */
+typedef struct arena {
+    pthread_mutex_t lock; /**< Protects everything below */
+    free_block *bins[SMALL_CLASS_COUNT]; /**< Free lists, one per small size class */
+    tree_block *trees[NUM_SIZE_CLASSES - SMALL_CLASS_COUNT]; /**< Free trees, one per larger size class */
+    uint64_t bin_map; /**< Bit i is set when size class i has a free block */
+    uintptr_t rover; /**< Block next fit handed out last */
+    header *fence; /**< Fence block at the end of the segment we grow next */
+    char *end; /**< First byte after the fence, the break when nobody else moved it */
+    free_block *top; /**< Free block right before the fence, kept off the free lists */
+    char *top_clean; /**< Top payload from here up to its footer was never written */
+    size_t grow_size; /**< Size of the next heap growth */
+    struct slab *slabs[SMALL_CLASS_COUNT]; /**< Slabs with free objects, one list per small class */
+    uint16_t index; /**< Position in ARENAS, stored in every block header */
+    uint64_t contended; /**< Times a thread found the lock taken and moved on */
+    uint64_t lock_acquisitions; /**< Times a thread locked the arena to allocate */
+    uint64_t grow_calls; /**< sbrk or mmap calls made to grow the heap */
+    uint64_t syscalls_avoided; /**< Heap misses served from the top chunk without a syscall */
+    uint64_t trim_calls; /**< sbrk or madvise calls made to give top memory back */
+    uint64_t bytes_returned; /**< Bytes given back to the OS by trimming */
+    uint64_t purge_epoch; /**< Purge ticks so far, free tree blocks remember it */
+    uint64_t next_purge; /**< Monotonic time in ns of the next purge tick */
+    uint64_t top_epoch; /**< Purge epoch when a freed block last merged into the top chunk */
+    uint64_t purge_calls; /**< madvise calls made to purge dirty free pages */
+    uint64_t bytes_purged; /**< Bytes of dirty free pages given back by purging */
+    uint64_t top_allocs; /**< Heap allocations carved from the top chunk because no free block fit */
+    size_t heap_size; /**< Bytes of heap segments obtained from the OS and not given back */
+    size_t allocated; /**< Payload bytes of heap blocks in use */
+    uint64_t allocs[NUM_SIZE_CLASSES]; /**< Heap blocks handed out */
+    uint64_t frees[NUM_SIZE_CLASSES]; /**< Heap blocks taken back */
+    uint64_t uncached_allocs[SMALL_CLASS_COUNT]; /**< Slab objects handed out without a thread cache */
+    uint64_t uncached_frees[SMALL_CLASS_COUNT]; /**< Slab objects freed without a thread cache */
+    uint32_t slab_count[SMALL_CLASS_COUNT]; /**< Slabs owned per small class */
+    _Alignas(64) void *remote; /**< Blocks other threads freed, pushed with CAS and not under the lock */
+    uint32_t remote_count; /**< Blocks pushed since the last drain, roughly, also not under the lock */
+    size_t remote_bytes; /**< Bytes those blocks span, roughly, also not under the lock */
+} arena;
+
+extern arena ARENAS[MAX_ARENAS];
+extern unsigned NUM_ARENAS;
+extern size_t PAGE_SIZE;
+extern int HUGE_PAGES; /**< Heaps and slabs are backed by transparent huge pages, from TUMALLOC_HUGEPAGES */
+
+#define HUGE_PAGE_SIZE (2UL << 20) /**< Size and alignment of a transparent huge page */
+
+void tumalloc_ensure_init(void);
+void corruption_detected(void);
+void remote_drain(arena *a);
+
+/**
+ * Map an aligned block size to its size class
+ *
+ * Sizes up to SMALL_CLASS_MAX get one class per ALIGNMENT step, so every
+ * block in a small class has exactly the same size. Larger sizes are split
+ * into CLASS_SUBDIVISIONS classes per power of two, and everything above the
+ * last medium class lands in the final, unbounded class.
+ *
+ * @param size The aligned size of the block
+ * @return The index of the size class holding blocks of that size
+ */
+static inline unsigned size_to_class(size_t size) {
+    if (size <= SMALL_CLASS_MAX) {
+        return (unsigned)((size - 1) / ALIGNMENT);
+    }
+
+    unsigned order = 63 - __builtin_clzl(size - 1);
+    unsigned group = order - 9;
+    unsigned sub = (unsigned)((size - 1) >> (order - 2)) & (CLASS_SUBDIVISIONS - 1);
+    unsigned cls = SMALL_CLASS_COUNT + group * CLASS_SUBDIVISIONS + sub;
+
+    return cls < NUM_SIZE_CLASSES - 1 ? cls : NUM_SIZE_CLASSES - 1;
+}
+
+#define SLAB_SIZE (64 * 1024) /**< Size and alignment of a slab */
+#define SLAB_MAGIC 0x51AB51AB /**< Magic number at the start of every slab */
+
+/**
+ * Metadata at the start of every slab
+ *
+ * The objects follow the header and its occupancy bitmap, so a slab is
+ * found from any object pointer by rounding down to SLAB_SIZE.
+ */
+typedef struct slab {
+    uint32_t magic; /**< SLAB_MAGIC, for error checking */
+    uint16_t cls; /**< Small size class of the objects */
+    uint16_t arena; /**< Index of the arena that owns the slab */
+    uint32_t size; /**< Size of each object */
+    uint32_t reciprocal; /**< 2^32 / size rounded up, turns the object index division into a multiply */
+    uint32_t capacity; /**< Number of objects in the slab */
+    uint32_t used; /**< Number of objects handed out */
+    uint32_t hint; /**< First bitmap word that may have a free object */
+    struct slab *next; /**< Next slab in the arena's list for this class */
+    struct slab *prev; /**< Previous slab in the arena's list for this class */
+    char *objects; /**< Address of the first object */
+    uint64_t bitmap[]; /**< One bit per object, set while the object is free */
+} slab;
+
+void tree_insert(arena *a, free_block *block);
+void tree_remove(arena *a, free_block *block);
+free_block *tree_find(arena *a, size_t size, int policy);
+
+void slab_init(void);
+unsigned slab_alloc(arena *a, unsigned cls, void **out, unsigned count);
+void slab_free(arena *a, void *ptr);
+unsigned slab_free_mask(arena *a, slab *s, size_t word, uint64_t mask);
+void slab_fork_lock(void);
+void slab_fork_unlock(void);
+void slab_region_stats(size_t *carved, size_t *pooled);
+
+/**
+ * Find the slab holding an object
+ *
+ * @param ptr A pointer inside the slab region
+ * @return The slab header
+ */
+static inline slab *slab_of(const void *ptr) {
+    return (slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/**
+ * Get the position of an object in its slab
+ *
+ * Multiplies by the reciprocal of the object size instead of dividing,
+ * which is exact for every offset inside a slab.
+ *
+ * @param s The slab holding the object
+ * @param ptr A pointer at or after the first object of the slab
+ * @return The index of the object the pointer falls in
+ */
+static inline size_t slab_index(const slab *s, const void *ptr) {
+    return (size_t)(((uint64_t)((const char *)ptr - s->objects) * s->reciprocal) >> 32);
+}
+
+/**
+ * Check whether an object is free in its slab
+ *
+ * Reads the bitmap without the arena lock, which is fine for catching a
+ * double free of an object that is no longer ours.
+ *
+ * @param s The slab holding the object
+ * @param index The position of the object in the slab
+ * @return Non-zero if the bit of the object is set
+ */
+static inline int slab_is_free(slab *s, size_t index) {
+    return (__atomic_load_n(&s->bitmap[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+#define PAGEMAP_SHIFT 12 /**< Every page map entry covers 4 KB, whatever the system page size */
+#define PAGEMAP_ADDRESS_BITS 47 /**< Bits of a user space address */
+#define PAGEMAP_LEAF_BITS 18 /**< Page number bits resolved by a leaf, 1 GB of address space */
+#define PAGEMAP_ROOT_BITS (PAGEMAP_ADDRESS_BITS - PAGEMAP_SHIFT - PAGEMAP_LEAF_BITS) /**< Page number bits resolved by the root */
+
+#define PAGE_SLAB 0x1 /**< The page belongs to a slab, the entry points to its descriptor */
+#define PAGE_HEAP 0x2 /**< The page belongs to an arena heap, the entry holds the arena index */
+#define PAGE_LARGE 0x3 /**< The page starts a mapped block, the entry points to its header */
+#define PAGE_TAG_MASK 0x3 /**< Bits of an entry holding its tag */
+
+#define PAGE_HEAP_ENTRY(index) (((uintptr_t)(index) << 2) | PAGE_HEAP) /**< Entry of a page in an arena heap */
+
+extern uintptr_t *PAGEMAP_ROOT[1UL << PAGEMAP_ROOT_BITS];
+
+int pagemap_set(const void *start, size_t length, uintptr_t entry);
+
+/**
+ * Look up the page map entry of a pointer
+ *
+ * Two dependent loads, the root and then the leaf. Pointers we never
+ * handed out, including those outside the user address space, get zero.
+ *
+ * @param ptr The pointer to look up
+ * @return The tagged entry of its page, or zero if the page is not ours
+ */
+static inline uintptr_t pagemap_get(const void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> PAGEMAP_SHIFT;
+
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) {
+        return 0;
+    }
+
+    uintptr_t *leaf = __atomic_load_n(&PAGEMAP_ROOT[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&leaf[page & ((1UL << PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_RELAXED);
+}
+
+/**
+ * Counters a thread keeps for its cached small objects
+ *
+ * Only the owning thread writes them, without locks or atomic read-modify-
+ * write instructions. Readers walk the list of live threads and add them up,
+ * and an exiting thread folds its counts into a global total.
+ */
+typedef struct thread_stats {
+    uint64_t allocs[SMALL_CLASS_COUNT]; /**< Small objects handed out */
+    uint64_t frees[SMALL_CLASS_COUNT]; /**< Small objects taken back */
+    uint64_t cache_misses; /**< Small allocations that had to refill the thread cache */
+    uint64_t cache_flushes; /**< Small frees that had to flush the thread cache */
+    struct thread_stats *next; /**< Next live thread */
+    struct thread_stats *prev; /**< Previous live thread */
+} thread_stats;
+
+/**
+ * Counters for blocks with their own mapping, updated atomically
+ */
+typedef struct large_stats {
+    uint64_t count; /**< Mapped blocks in use */
+    uint64_t bytes; /**< Bytes in their mappings */
+    uint64_t mmap_calls; /**< mmap calls made for them */
+    uint64_t munmap_calls; /**< munmap calls made for them */
+    uint64_t mremap_calls; /**< mremap calls made for them */
+} large_stats;
+
+extern __thread thread_stats THREAD_STATS;
+extern large_stats LARGE_STATS;
+
+/** Add to a counter only the calling thread writes, so readers never see a torn value */
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+/** Add to a counter shared by all threads */
+#define STAT_ADD_SHARED(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+void stats_register(void);
+void stats_unregister(void);
+void stats_fork_lock(void);
+void stats_fork_unlock(void);
+
+/**
+ * Output buffer for tumalloc_info and tumalloc_profile
+ *
+ * Reports are formatted into a stack buffer and written with write(2), so
+ * they never allocate.
+ */
+typedef struct report {
+    int fd; /**< Where the report goes */
+    int failed; /**< Set once a write failed */
+    size_t used; /**< Bytes waiting in buf */
+    char buf[4096]; /**< Formatted text not written yet */
+} report;
+
+void report_flush(report *r);
+__attribute__((format(printf, 2, 3))) void report_add(report *r, const char *format, ...);
+
+extern int TRACE_ENABLED; /**< Set once at startup when TUMALLOC_TRACE names a file */
+
+/** Record an allocator call when tracing is on, see trace.h for the operations */
+#define TRACE(op, ptr, arg, size) \
+    do { \
+        if (__builtin_expect(TRACE_ENABLED, 0)) { \
+            trace_event((op), (ptr), (uintptr_t)(arg), (size)); \
+        } \
+    } while (0)
+
+void trace_init(void);
+void trace_event(uint32_t op, const void *ptr, uintptr_t arg, size_t size);
+void trace_fork_child(void);
+
+extern uint64_t PROF_RATE; /**< Mean bytes between heap profile samples, 0 while sampling is off */
+extern __thread int64_t PROF_COUNTDOWN; /**< Bytes the calling thread allocates before its next sample */
+
+/** Count an allocation towards the next heap profile sample, one decrement and branch when sampling is off */
+#define PROFILE(ptr, size) \
+    do { \
+        if (__builtin_expect((PROF_COUNTDOWN -= (int64_t)(size)) < 0, 0)) { \
+            prof_sample((ptr), (size)); \
+        } \
+    } while (0)
+
+/** Drop a block that is being freed from the heap profile, if it was sampled */
+#define PROFILE_FREE(ptr) \
+    do { \
+        if (__builtin_expect(PROF_RATE != 0, 0)) { \
+            prof_free(ptr); \
+        } \
+    } while (0)
+
+void prof_init(uint64_t rate, const char *path);
+void prof_sample(void *ptr, size_t size);
+void prof_free(const void *ptr);
+void prof_fork_lock(void);
+void prof_fork_unlock(void);
+
+#pragma GCC visibility pop
+
+#endif //CYB3053_PROJECT2_ALLOC_INTERNAL_H
@@ -102,15 +102,24 @@ int list_remove(node **list, int index) {
 /**
  * Remove all elements from the list
  *
+ * Collects the nodes in chunks and hands each chunk to tufree_batch.
+ *
  * @param list The list to remove elements from
  */
 void list_remove_all(node *list) {
+    void *chunk[256];
+    size_t count = 0;
+
     node *curr = list;
     while (curr) {
-        node *next = curr->next;
-        tufree(curr);
-        curr = next;
+        chunk[count++] = curr;
+        curr = curr->next;
+        if (count == sizeof(chunk) / sizeof(chunk[0])) {
+            tufree_batch(chunk, count);
+            count = 0;
+        }
     }
+    tufree_batch(chunk, count);
 }
 
 /**
@@ -253,7 +262,7 @@ int main(int argc, char** argv) {
     }
 
     // Free the allocated memory
-    tufree(more_things);
+    tufree(bigger_things);
 
     return 0;
 }
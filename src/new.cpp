@@ -0,0 +1,132 @@
+/*
+ * Replaceable global operator new and delete, built into libtumalloc_cxx.so
+ * on top of the interposed functions of libtumalloc.so. Going through them
+ * rather than the tu* functions keeps their guard against re-entering the
+ * allocator. Sized deletes drop the size, the allocator finds it in the
+ * page map and the block's own metadata.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+/**
+ * Allocate memory, calling the new handler until it works
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, 0 for the natural one
+ * @return A pointer to the memory
+ */
+void *allocate(std::size_t size, std::size_t alignment) {
+    for (;;) {
+        void *ptr = alignment == 0 ? std::malloc(size) : std::aligned_alloc(alignment, size ? size : 1);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+/**
+ * Allocate memory, returning NULL instead of throwing
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, 0 for the natural one
+ * @return A pointer to the memory, or NULL
+ */
+void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define PAGEMAP_LEAF_SIZE ((1UL << PAGEMAP_LEAF_BITS) * sizeof(uintptr_t)) /**< Bytes in a leaf */
+
+uintptr_t *PAGEMAP_ROOT[1UL << PAGEMAP_ROOT_BITS];
+
+/**
+ * Get the leaf covering a page number, mapping it on first use
+ *
+ * Leaves are never freed. Two threads racing for the same leaf both map
+ * one and the loser gives its copy back.
+ *
+ * @param page The page number
+ * @return The leaf or NULL if it could not be mapped
+ */
+static uintptr_t *pagemap_leaf(uintptr_t page) {
+    uintptr_t **slot = &PAGEMAP_ROOT[page >> PAGEMAP_LEAF_BITS];
+    uintptr_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (leaf != NULL) {
+        return leaf;
+    }
+
+    uintptr_t *fresh = mmap(NULL, PAGEMAP_LEAF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(slot, &leaf, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(fresh, PAGEMAP_LEAF_SIZE);
+        return leaf;
+    }
+    return fresh;
+}
+
+/**
+ * Point every page of a range at the same entry
+ *
+ * The caller owns the range, so no other thread writes these entries at
+ * the same time. Clearing a range with a zero entry never fails.
+ *
+ * @param start The start of the range
+ * @param length The length of the range in bytes, at least one
+ * @param entry The tagged entry, or zero to forget the range
+ * @return Non-zero on success, zero if a leaf could not be mapped
+ */
+int pagemap_set(const void *start, size_t length, uintptr_t entry) {
+    uintptr_t page = (uintptr_t)start >> PAGEMAP_SHIFT;
+    uintptr_t last = ((uintptr_t)start + length - 1) >> PAGEMAP_SHIFT;
+
+    while (page <= last) {
+        uintptr_t *leaf;
+        if (entry != 0) {
+            leaf = pagemap_leaf(page);
+            if (leaf == NULL) {
+                return 0;
+            }
+        } else {
+            leaf = __atomic_load_n(&PAGEMAP_ROOT[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+        }
+
+        // Fill up to the end of this leaf
+        uintptr_t leaf_end = (page | ((1UL << PAGEMAP_LEAF_BITS) - 1)) + 1;
+        uintptr_t stop = last + 1 < leaf_end ? last + 1 : leaf_end;
+        if (leaf != NULL) {
+            for (uintptr_t p = page; p < stop; p++) {
+                __atomic_store_n(&leaf[p & ((1UL << PAGEMAP_LEAF_BITS) - 1)], entry, __ATOMIC_RELAXED);
+            }
+        }
+        page = stop;
+    }
+
+    return 1;
+}
@@ -0,0 +1,576 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Persistent heaps: a file mapped with MAP_SHARED and managed like an
+ * arena, with boundary tags, size classes and a bitmap of non-empty
+ * classes. Everything the heap keeps about itself, the free lists and the
+ * root object included, sits inside the file and links by offset, so the
+ * file can be mapped anywhere the next time it is opened.
+ */
+
+#define PHEAP_MAGIC 0x3170616568757475ULL /**< "tuheap1" at the start of every heap file */
+#define PHEAP_VERSION 1 /**< Layout version of the heap file */
+#define PHEAP_START 4096 /**< Offset of the first block, the superblock takes the space before */
+#define PHEAP_MIN_SIZE (64 * 1024) /**< Smallest heap file we create */
+
+#define PBLOCK_USED 0x7E510CA7 /**< Magic number of a block in use */
+#define PBLOCK_FREE 0x7E51F4EE /**< Magic number of a free block */
+
+#define PBLOCK_PREV_FREE 0x1 /**< The previous block is free and its footer is valid */
+#define PBLOCK_FENCE 0x2 /**< Zero sized block at the end of the heap */
+
+#define PBLOCK_MIN 32 /**< Smallest payload that fits the free list links and a footer */
+
+/**
+ * The start of a heap file
+ *
+ * Free lists hold offsets from the start of the file, zero ends a list.
+ * dirty is set while a process has the heap open and cleared when it is
+ * closed, so a heap found dirty was not closed and is checked on open.
+ */
+typedef struct pheap_super {
+    uint64_t magic; /**< PHEAP_MAGIC */
+    uint32_t version; /**< PHEAP_VERSION */
+    uint32_t dirty; /**< Non-zero while the heap is open */
+    uint64_t size; /**< Size of the file */
+    uint64_t root; /**< Offset of the root object, zero for none */
+    uint64_t allocated; /**< Payload bytes of blocks in use */
+    uint64_t bin_map; /**< Bit i is set when size class i has a free block */
+    uint64_t bins[NUM_SIZE_CLASSES]; /**< Free lists, one per size class */
+} pheap_super;
+
+/**
+ * A free block of a persistent heap, the free_block layout with offsets
+ */
+typedef struct pheap_block {
+    size_t size; /**< Size of the block */
+    uint32_t magic; /**< PBLOCK_FREE */
+    uint16_t flags; /**< PBLOCK_PREV_FREE, PBLOCK_FENCE */
+    uint16_t unused; /**< Zero, the arena index of the other heaps */
+    uint64_t next; /**< Offset of the next free block of the class */
+    uint64_t prev; /**< Offset of the previous free block of the class */
+} pheap_block;
+
+/**
+ * An open persistent heap
+ */
+struct tuheap {
+    pthread_mutex_t lock; /**< Protects the mapping */
+    char *base; /**< Start of the mapping */
+    size_t size; /**< Size of the mapping and the file */
+    int fd; /**< The file, locked so only one process uses it */
+};
+
+/**
+ * Get the superblock of a heap
+ *
+ * @param h The heap
+ * @return Its superblock
+ */
+static inline pheap_super *pheap_sb(tuheap *h) {
+    return (pheap_super *)h->base;
+}
+
+/**
+ * Turn an offset into the block there
+ *
+ * @param h The heap
+ * @param offset A block offset, not zero
+ * @return The block
+ */
+static inline pheap_block *pheap_at(tuheap *h, uint64_t offset) {
+    return (pheap_block *)(h->base + offset);
+}
+
+/**
+ * Turn a block into its offset
+ *
+ * @param h The heap
+ * @param b The block
+ * @return Its offset
+ */
+static inline uint64_t pheap_off(tuheap *h, pheap_block *b) {
+    return (uint64_t)((char *)b - h->base);
+}
+
+/**
+ * Get the block that follows a block in the file
+ *
+ * @param b The block
+ * @return The next block, which may be the fence
+ */
+static inline pheap_block *pheap_next(pheap_block *b) {
+    return (pheap_block *)((char *)b + sizeof(header) + b->size);
+}
+
+/**
+ * File a free block on the list of its size class
+ *
+ * Also marks it free, writes its footer and tells the next block.
+ *
+ * @param h The heap
+ * @param b The block
+ */
+static void pheap_insert(tuheap *h, pheap_block *b) {
+    pheap_super *sb = pheap_sb(h);
+    unsigned cls = size_to_class(b->size);
+
+    b->magic = PBLOCK_FREE;
+    b->prev = 0;
+    b->next = sb->bins[cls];
+    if (b->next != 0) {
+        pheap_at(h, b->next)->prev = pheap_off(h, b);
+    }
+    sb->bins[cls] = pheap_off(h, b);
+    sb->bin_map |= 1ULL << cls;
+
+    *(size_t *)((char *)b + sizeof(header) + b->size - sizeof(size_t)) = b->size;
+    pheap_next(b)->flags |= PBLOCK_PREV_FREE;
+}
+
+/**
+ * Take a free block off the list of its size class
+ *
+ * @param h The heap
+ * @param b The block, with the size it was filed under
+ */
+static void pheap_remove(tuheap *h, pheap_block *b) {
+    pheap_super *sb = pheap_sb(h);
+    unsigned cls = size_to_class(b->size);
+
+    if (b->prev != 0) {
+        pheap_at(h, b->prev)->next = b->next;
+    } else {
+        sb->bins[cls] = b->next;
+        if (sb->bins[cls] == 0) {
+            sb->bin_map &= ~(1ULL << cls);
+        }
+    }
+    if (b->next != 0) {
+        pheap_at(h, b->next)->prev = b->prev;
+    }
+}
+
+/**
+ * Find a free block of at least size bytes and take it off its list
+ *
+ * The request's own class is searched for the first block that fits,
+ * every larger class fits as a whole and gives up its first block.
+ *
+ * @param h The heap
+ * @param size The aligned size
+ * @return The block, or NULL if the heap is full
+ */
+static pheap_block *pheap_find(tuheap *h, size_t size) {
+    pheap_super *sb = pheap_sb(h);
+    unsigned cls = size_to_class(size);
+    pheap_block *found = NULL;
+
+    for (uint64_t off = sb->bins[cls]; off != 0 && found == NULL; off = pheap_at(h, off)->next) {
+        if (pheap_at(h, off)->size >= size) {
+            found = pheap_at(h, off);
+        }
+    }
+    if (found == NULL) {
+        uint64_t larger = cls < NUM_SIZE_CLASSES - 1 ? sb->bin_map & (~0ULL << (cls + 1)) : 0;
+        if (larger == 0) {
+            return NULL;
+        }
+        found = pheap_at(h, sb->bins[__builtin_ctzll(larger)]);
+    }
+
+    pheap_remove(h, found);
+    return found;
+}
+
+/**
+ * Get the fence at the end of a heap file
+ *
+ * @param h The heap
+ * @return Where the fence belongs
+ */
+static inline pheap_block *pheap_fence(tuheap *h) {
+    return (pheap_block *)(h->base + ((h->size - sizeof(header)) & ~(uint64_t)(ALIGNMENT - 1)));
+}
+
+/**
+ * Walk every block of a heap file without changing it
+ *
+ * Any block header that does not hold together, a missing fence or a root
+ * that is not the payload of a block in use fails the check.
+ *
+ * @param h The heap
+ * @return Non-zero if the heap holds together
+ */
+static int pheap_check(tuheap *h) {
+    pheap_super *sb = pheap_sb(h);
+    char *fence = (char *)pheap_fence(h);
+    int root_found = sb->root == 0;
+
+    for (pheap_block *b = (pheap_block *)(h->base + PHEAP_START); (char *)b != fence; b = pheap_next(b)) {
+        if ((char *)b > fence - sizeof(header) || b->size % ALIGNMENT != 0
+            || b->size > (size_t)(fence - (char *)b) - sizeof(header)
+            || (b->magic != PBLOCK_USED && b->magic != PBLOCK_FREE)) {
+            return 0;
+        }
+        if (b->magic == PBLOCK_USED) {
+            root_found |= sb->root == pheap_off(h, b) + sizeof(header);
+        }
+    }
+
+    pheap_block *end = (pheap_block *)fence;
+    return end->size == 0 && (end->flags & PBLOCK_FENCE) && root_found;
+}
+
+/**
+ * Rebuild the free lists of a heap file that passed pheap_check
+ *
+ * Runs of free blocks are merged, and free lists, flags and the allocated
+ * count are rebuilt from the blocks alone, so a crash in the middle of
+ * updating them loses nothing. Blocks split or merged only write the
+ * header that makes the change visible last.
+ *
+ * @param h The heap
+ */
+static void pheap_rebuild(tuheap *h) {
+    pheap_super *sb = pheap_sb(h);
+    pheap_block *end = pheap_fence(h);
+
+    memset(sb->bins, 0, sizeof(sb->bins));
+    sb->bin_map = 0;
+    sb->allocated = 0;
+
+    pheap_block *run = NULL;
+    for (pheap_block *b = (pheap_block *)(h->base + PHEAP_START); b != end;) {
+        pheap_block *next = pheap_next(b);
+        b->flags &= ~PBLOCK_PREV_FREE;
+        if (b->magic == PBLOCK_USED) {
+            if (run != NULL) {
+                pheap_insert(h, run);
+                run = NULL;
+            }
+            sb->allocated += b->size;
+        } else if (run != NULL) {
+            run->size += sizeof(header) + b->size;
+        } else {
+            run = b;
+        }
+        b = next;
+    }
+
+    end->flags = PBLOCK_FENCE;
+    if (run != NULL) {
+        pheap_insert(h, run);
+    }
+}
+
+/**
+ * Check a heap that was not closed and rebuild its free lists
+ *
+ * The file is only written once the whole check has passed, so a damaged
+ * heap is left as it was found.
+ *
+ * @param h The heap
+ * @return Non-zero if the heap holds together
+ */
+static int pheap_recover(tuheap *h) {
+    if (!pheap_check(h)) {
+        return 0;
+    }
+    pheap_rebuild(h);
+    return 1;
+}
+
+/**
+ * Lay out an empty heap in a fresh file
+ *
+ * @param h The heap
+ */
+static void pheap_format(tuheap *h) {
+    pheap_super *sb = pheap_sb(h);
+    header *fence = (header *)pheap_fence(h);
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = PHEAP_MAGIC;
+    sb->version = PHEAP_VERSION;
+    sb->size = h->size;
+
+    fence->size = 0;
+    fence->magic = PBLOCK_USED;
+    fence->flags = PBLOCK_FENCE;
+    fence->arena = 0;
+
+    pheap_block *b = (pheap_block *)(h->base + PHEAP_START);
+    b->size = (char *)fence - (char *)b - sizeof(header);
+    b->flags = 0;
+    b->unused = 0;
+    pheap_insert(h, b);
+}
+
+/**
+ * Opens a persistent heap, creating its file if needed
+ *
+ * A new or empty file is grown to size bytes and formatted. An existing
+ * heap keeps its size and is mapped wherever the kernel likes, and a heap
+ * that was not closed, because its process crashed, is checked and its
+ * free lists rebuilt. Only one process may have a heap open at a time.
+ *
+ * @param path The file holding the heap
+ * @param size The size of a new heap, rounded up to whole pages
+ * @return The heap, or NULL with errno set, EUCLEAN if the file is damaged
+ */
+tuheap *tuheap_open(const char *path, size_t size) {
+    tuheap *h = tumalloc(sizeof(tuheap));
+    if (h == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    h->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (h->fd < 0) {
+        tufree(h);
+        return NULL;
+    }
+
+    struct stat st;
+    int err = 0;
+    if (flock(h->fd, LOCK_EX | LOCK_NB) != 0 || fstat(h->fd, &st) != 0) {
+        err = errno;
+    } else if (st.st_size == 0) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        if (size < PHEAP_MIN_SIZE) {
+            size = PHEAP_MIN_SIZE;
+        }
+        h->size = (size + page - 1) & ~(page - 1);
+        if (ftruncate(h->fd, (off_t)h->size) != 0) {
+            err = errno;
+        }
+    } else if ((size_t)st.st_size < PHEAP_MIN_SIZE) {
+        err = EUCLEAN;
+    } else {
+        h->size = (size_t)st.st_size;
+    }
+
+    if (err == 0) {
+        h->base = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+        if (h->base == MAP_FAILED) {
+            err = errno;
+        }
+    }
+
+    if (err == 0) {
+        pheap_super *sb = pheap_sb(h);
+        if (st.st_size == 0) {
+            pheap_format(h);
+        } else if (sb->magic != PHEAP_MAGIC || sb->version != PHEAP_VERSION || sb->size != h->size
+                   || (sb->dirty && !pheap_recover(h))) {
+            munmap(h->base, h->size);
+            err = EUCLEAN;
+        }
+    }
+
+    if (err != 0) {
+        close(h->fd);
+        tufree(h);
+        errno = err;
+        return NULL;
+    }
+
+    // From here on, a crash leaves the heap marked for checking
+    pheap_sb(h)->dirty = 1;
+    msync(h->base, PHEAP_START, MS_SYNC);
+    pthread_mutex_init(&h->lock, NULL);
+    return h;
+}
+
+/**
+ * Writes every change to a persistent heap out to its file
+ *
+ * @param h The heap
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int tuheap_sync(tuheap *h) {
+    pthread_mutex_lock(&h->lock);
+    int result = msync(h->base, h->size, MS_SYNC);
+    pthread_mutex_unlock(&h->lock);
+    return result;
+}
+
+/**
+ * Closes a persistent heap
+ *
+ * Writes it out, marks it clean and unmaps it. Pointers into the heap are
+ * no longer valid, offsets stay valid for the next tuheap_open.
+ *
+ * @param h The heap, or NULL
+ * @return 0 on success, -1 with errno set if the heap could not be written out
+ */
+int tuheap_close(tuheap *h) {
+    if (h == NULL) {
+        return 0;
+    }
+
+    int result = msync(h->base, h->size, MS_SYNC);
+    if (result == 0) {
+        pheap_sb(h)->dirty = 0;
+        result = msync(h->base, PHEAP_START, MS_SYNC);
+    }
+    int err = errno;
+
+    munmap(h->base, h->size);
+    close(h->fd);
+    pthread_mutex_destroy(&h->lock);
+    tufree(h);
+    errno = err;
+    return result;
+}
+
+/**
+ * Allocates memory in a persistent heap
+ *
+ * Works like tumalloc, but the heap never grows past the size of its file.
+ *
+ * @param h The heap
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, or NULL if size is zero or the heap is full
+ */
+void *tuheap_alloc(tuheap *h, size_t size) {
+    if (size == 0 || size > h->size) {
+        return NULL;
+    }
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if (size < PBLOCK_MIN) {
+        size = PBLOCK_MIN;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    pheap_block *b = pheap_find(h, size);
+    if (b == NULL) {
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+
+    // Split off the tail, its header goes in before the block shrinks
+    if (b->size >= size + sizeof(header) + PBLOCK_MIN) {
+        pheap_block *tail = (pheap_block *)((char *)b + sizeof(header) + size);
+        tail->size = b->size - size - sizeof(header);
+        tail->flags = 0;
+        tail->unused = 0;
+        pheap_insert(h, tail);
+        b->size = size;
+    } else {
+        pheap_next(b)->flags &= ~PBLOCK_PREV_FREE;
+    }
+    b->magic = PBLOCK_USED;
+    pheap_sb(h)->allocated += b->size;
+    pthread_mutex_unlock(&h->lock);
+
+    return (char *)b + sizeof(header);
+}
+
+/**
+ * Frees memory of a persistent heap
+ *
+ * Works like tufree: freeing twice is ignored, and pointers that are not
+ * block payloads of the heap abort. Free neighbors are merged right away.
+ *
+ * @param h The heap
+ * @param ptr Pointer from tuheap_alloc, or NULL
+ */
+void tuheap_free(tuheap *h, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if ((char *)ptr < h->base + PHEAP_START + sizeof(header) || (char *)ptr >= h->base + h->size
+        || ((uintptr_t)ptr - (uintptr_t)h->base) % ALIGNMENT != 0) {
+        corruption_detected();
+    }
+
+    pthread_mutex_lock(&h->lock);
+    pheap_block *b = (pheap_block *)((char *)ptr - sizeof(header));
+    if (b->magic == PBLOCK_FREE) {
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+    if (b->magic != PBLOCK_USED || (b->flags & PBLOCK_FENCE)) {
+        corruption_detected();
+    }
+    pheap_sb(h)->allocated -= b->size;
+    b->magic = PBLOCK_FREE;
+
+    pheap_block *next = pheap_next(b);
+    if (next->magic == PBLOCK_FREE) {
+        pheap_remove(h, next);
+        b->size += sizeof(header) + next->size;
+    }
+    if (b->flags & PBLOCK_PREV_FREE) {
+        size_t prev_size = *(size_t *)((char *)b - sizeof(size_t));
+        pheap_block *prev = (pheap_block *)((char *)b - prev_size - sizeof(header));
+        pheap_remove(h, prev);
+        prev->size += sizeof(header) + b->size;
+        b = prev;
+    }
+    pheap_insert(h, b);
+    pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * Gets the root object of a persistent heap
+ *
+ * The root is where a program finds its data again after reopening.
+ *
+ * @param h The heap
+ * @return The root object, or NULL if none was set
+ */
+void *tuheap_root(tuheap *h) {
+    uint64_t root = __atomic_load_n(&pheap_sb(h)->root, __ATOMIC_ACQUIRE);
+    return root != 0 ? h->base + root : NULL;
+}
+
+/**
+ * Sets the root object of a persistent heap
+ *
+ * @param h The heap
+ * @param ptr Pointer from tuheap_alloc, or NULL to clear the root
+ */
+void tuheap_set_root(tuheap *h, void *ptr) {
+    __atomic_store_n(&pheap_sb(h)->root, ptr != NULL ? tuheap_offset(h, ptr) : 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Turns a pointer into a persistent heap into an offset
+ *
+ * Data structures in the heap should link by offset, since the heap may be
+ * mapped somewhere else the next time it is opened.
+ *
+ * @param h The heap
+ * @param ptr A pointer into the heap, or NULL
+ * @return Its offset, zero for NULL
+ */
+uint64_t tuheap_offset(tuheap *h, const void *ptr) {
+    return ptr != NULL ? (uint64_t)((const char *)ptr - h->base) : 0;
+}
+
+/**
+ * Turns an offset from tuheap_offset back into a pointer
+ *
+ * @param h The heap
+ * @param offset The offset, or zero
+ * @return The pointer, NULL for zero
+ */
+void *tuheap_pointer(tuheap *h, uint64_t offset) {
+    return offset != 0 ? h->base + offset : NULL;
+}
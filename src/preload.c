@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include "alloc.h"
+
+/*
+ * Drop-in replacements for the C library allocation functions, built into
+ * libtumalloc.so for use with LD_PRELOAD. Allocator code can end up calling
+ * malloc itself, for instance through the C library during the first
+ * initialization or when pthread_setspecific grows its key table, so
+ * such nested calls are served from a static buffer instead of recursing.
+ * Nested frees are put off until the outermost call is done.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BOOTSTRAP_SIZE (64 * 1024) /**< Memory for allocations made while the allocator itself is running */
+
+/**
+ * Memory handed out to calls that re-enter the allocator
+ *
+ * Every chunk starts with a 16 byte prefix holding its size, so realloc and
+ * malloc_usable_size work on it too. Chunks are never reused.
+ */
+static _Alignas(16) char BOOTSTRAP[BOOTSTRAP_SIZE];
+static size_t BOOTSTRAP_USED = 0; /**< Bytes of BOOTSTRAP handed out so far */
+
+static __thread int IN_ALLOCATOR = 0; /**< Set while the calling thread runs allocator code */
+static __thread void *DEFERRED = NULL; /**< Blocks freed while IN_ALLOCATOR was set, linked through their first word */
+
+/**
+ * Serve an allocation from the bootstrap buffer
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, or NULL once the buffer is used up
+ */
+static void *bootstrap_alloc(size_t size) {
+    size_t total = 16 + ((size + 15) & ~(size_t)15);
+    if (size > BOOTSTRAP_SIZE) {
+        return NULL;
+    }
+
+    size_t offset = __atomic_fetch_add(&BOOTSTRAP_USED, total, __ATOMIC_RELAXED);
+    if (offset + total > BOOTSTRAP_SIZE) {
+        return NULL;
+    }
+
+    *(size_t *)(BOOTSTRAP + offset) = size;
+    return BOOTSTRAP + offset + 16;
+}
+
+/**
+ * Check whether a pointer came from the bootstrap buffer
+ *
+ * @param ptr The pointer to check
+ * @return Non-zero if the pointer lies in BOOTSTRAP
+ */
+static inline int is_bootstrap(const void *ptr) {
+    return (const char *)ptr >= BOOTSTRAP && (const char *)ptr < BOOTSTRAP + BOOTSTRAP_SIZE;
+}
+
+/**
+ * Get the size of a bootstrap chunk
+ *
+ * @param ptr A pointer from bootstrap_alloc
+ * @return The size that was requested for it
+ */
+static inline size_t bootstrap_size(const void *ptr) {
+    return *(const size_t *)((const char *)ptr - 16);
+}
+
+/**
+ * Finish a call into the allocator
+ *
+ * Frees the blocks that nested calls put off, with the guard still set so
+ * anything those frees allocate or free again is handled the same way.
+ */
+static void release(void) {
+    while (DEFERRED != NULL) {
+        void *ptr = DEFERRED;
+        DEFERRED = *(void **)ptr;
+        tufree(ptr);
+    }
+    IN_ALLOCATOR = 0;
+}
+
+/**
+ * Finish an allocation call, setting errno when it failed
+ *
+ * @param ptr The result of the call
+ * @return ptr
+ */
+static inline void *leave(void *ptr) {
+    release();
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Allocates memory, interposing the C library
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, unique even for zero bytes
+ */
+void *malloc(size_t size) {
+    if (IN_ALLOCATOR) {
+        return bootstrap_alloc(size);
+    }
+    IN_ALLOCATOR = 1;
+    return leave(tumalloc(size ? size : 1));
+}
+
+/**
+ * Frees memory, interposing the C library
+ *
+ * @param ptr The memory to free
+ */
+void free(void *ptr) {
+    if (ptr == NULL || is_bootstrap(ptr)) {
+        return;
+    }
+    // The allocator may hold a lock, and the guard must stay set for the rest of its call
+    if (IN_ALLOCATOR) {
+        *(void **)ptr = DEFERRED;
+        DEFERRED = ptr;
+        return;
+    }
+    IN_ALLOCATOR = 1;
+    tufree(ptr);
+    release();
+}
+
+/**
+ * Frees memory of a known size, the C23 function
+ *
+ * The size is of no use to the allocator, see tufree_sized.
+ *
+ * @param ptr The memory to free
+ * @param size The size it was allocated with
+ */
+void free_sized(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+/**
+ * Frees aligned memory of a known size, the C23 function
+ *
+ * @param ptr The memory to free
+ * @param alignment The alignment it was allocated with
+ * @param size The size it was allocated with
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+    (void)alignment;
+    (void)size;
+    free(ptr);
+}
+
+/**
+ * Allocates zeroed memory, interposing the C library
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the zeroed memory
+ */
+void *calloc(size_t num, size_t size) {
+    if (IN_ALLOCATOR) {
+        // The bootstrap buffer starts zeroed and is never reused
+        if (size != 0 && num > SIZE_MAX / size) {
+            return NULL;
+        }
+        return bootstrap_alloc(num * size);
+    }
+    IN_ALLOCATOR = 1;
+    if (num == 0 || size == 0) {
+        num = size = 1;
+    }
+    return leave(tucalloc(num, size));
+}
+
+/**
+ * Resizes memory, interposing the C library
+ *
+ * @param ptr The memory to resize, or NULL
+ * @param size The new size, zero frees ptr
+ * @return A pointer to the resized memory
+ */
+void *realloc(void *ptr, size_t size) {
+    if (ptr != NULL && is_bootstrap(ptr)) {
+        void *moved = malloc(size ? size : 1);
+        if (moved != NULL) {
+            size_t old_size = bootstrap_size(ptr);
+            memcpy(moved, ptr, old_size < size ? old_size : size);
+        }
+        return moved;
+    }
+    if (IN_ALLOCATOR) {
+        return ptr == NULL ? bootstrap_alloc(size) : NULL;
+    }
+    if (ptr != NULL && size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    IN_ALLOCATOR = 1;
+    return leave(turealloc(ptr, size ? size : 1));
+}
+
+/**
+ * Resizes an array, interposing the C library
+ *
+ * The C library's own version would not come back to our realloc.
+ *
+ * @param ptr The memory to resize, or NULL
+ * @param num The new number of elements
+ * @param size The size of each element
+ * @return A pointer to the resized memory, or NULL on overflow
+ */
+void *reallocarray(void *ptr, size_t num, size_t size) {
+    if (size != 0 && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, num * size);
+}
+
+/**
+ * Allocates aligned memory, interposing the C library
+ *
+ * @param memptr Where the pointer to the memory goes
+ * @param alignment The alignment, a power of two and a multiple of sizeof(void *)
+ * @param size The amount of memory to allocate
+ * @return 0 on success, EINVAL or ENOMEM otherwise
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (IN_ALLOCATOR) {
+        return ENOMEM;
+    }
+    IN_ALLOCATOR = 1;
+    int result = tuposix_memalign(memptr, alignment, size ? size : 1);
+    release();
+    return result;
+}
+
+/**
+ * Allocates aligned memory, interposing the C library
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, or NULL with errno set
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (IN_ALLOCATOR) {
+        return NULL;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    IN_ALLOCATOR = 1;
+    return leave(tualigned_alloc(alignment, size ? size : 1));
+}
+
+/**
+ * Allocates aligned memory, interposing the C library
+ *
+ * @param alignment The alignment, rounded up to a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory
+ */
+void *memalign(size_t alignment, size_t size) {
+    if (IN_ALLOCATOR) {
+        return NULL;
+    }
+    IN_ALLOCATOR = 1;
+    return leave(tumemalign(alignment, size ? size : 1));
+}
+
+/**
+ * Allocates page aligned memory, interposing the C library
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory
+ */
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+/**
+ * Allocates whole pages, interposing the C library
+ *
+ * @param size The amount of memory to allocate, rounded up to the page size
+ * @return A pointer to the memory
+ */
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/**
+ * Gets the usable size of a block, interposing the C library
+ *
+ * @param ptr A pointer from one of the functions above
+ * @return The number of bytes the block can hold
+ */
+size_t malloc_usable_size(void *ptr) {
+    if (ptr != NULL && is_bootstrap(ptr)) {
+        return bootstrap_size(ptr);
+    }
+    return tumalloc_usable_size(ptr);
+}
+
+/**
+ * Gives free memory back to the OS, interposing the C library
+ *
+ * @param pad Ignored, the top chunks keep what they need anyway
+ * @return 1 if any memory was given back, 0 otherwise
+ */
+int malloc_trim(size_t pad) {
+    (void)pad;
+    return tumalloc_purge() > 0;
+}
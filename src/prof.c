@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROF_DEPTH 32 /**< Most frames kept of a sampled stack */
+#define PROF_STACKS 4096 /**< Distinct stacks the profile can hold, a power of two */
+#define PROF_SAMPLES 65536 /**< Live samples the profile can hold, a power of two */
+#define PROF_TOMBSTONE 1 /**< Pointer of a sample slot that was freed and may be reused */
+
+/**
+ * A call stack that allocated sampled memory, and what it allocated
+ *
+ * Counts are of samples, pprof scales them back up using the sample rate.
+ */
+typedef struct prof_stack {
+    uint64_t hash; /**< Hash of the frames, zero while the slot is unused */
+    uint32_t depth; /**< Frames in pcs */
+    uint64_t live_count; /**< Sampled blocks still allocated */
+    uint64_t live_bytes; /**< Requested bytes of those blocks */
+    uint64_t total_count; /**< Sampled blocks ever allocated */
+    uint64_t total_bytes; /**< Requested bytes of those blocks */
+    void *pcs[PROF_DEPTH]; /**< Return addresses, innermost first */
+} prof_stack;
+
+/**
+ * A sampled block that is still allocated
+ *
+ * Frees look up their pointer without the lock, so the pointer is written
+ * last when a sample goes in.
+ */
+typedef struct prof_sample_slot {
+    uintptr_t ptr; /**< The block, 0 for an empty slot or PROF_TOMBSTONE */
+    uint32_t stack; /**< Index of the stack in STACKS */
+    uint32_t unused; /**< Padding */
+    uint64_t size; /**< Requested bytes */
+} prof_sample_slot;
+
+uint64_t PROF_RATE = 0;
+__thread int64_t PROF_COUNTDOWN = 0;
+
+static __thread uint64_t PROF_RANDOM = 0; /**< xorshift state of the calling thread */
+static __thread int PROF_BUSY = 0; /**< Set while the calling thread takes a sample */
+
+static prof_stack *STACKS = NULL; /**< Hash table of sampled stacks, PROF_STACKS entries */
+static prof_sample_slot *SAMPLES = NULL; /**< Hash table of live samples, PROF_SAMPLES entries */
+static size_t SAMPLE_SLOTS_USED = 0; /**< Slots of SAMPLES holding a sample or a tombstone */
+static uint64_t DROPPED = 0; /**< Samples lost because a table was full */
+static const char *PROF_PATH = NULL; /**< File the profile is written to at exit */
+static pthread_mutex_t PROF_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Protects the tables, except lookups in SAMPLES */
+
+/**
+ * Hash a pointer or a stack hash to a table index
+ *
+ * @param x The value
+ * @return Its mixed bits
+ */
+static inline uint64_t prof_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * Natural logarithm, good to about five digits, without libm
+ *
+ * @param x A number above zero
+ * @return Its logarithm
+ */
+static double prof_log(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+
+    // ln m = 2 atanh((m - 1) / (m + 1)) for m in [1, 2)
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double series = t * (2.0 + t2 * (2.0 / 3.0 + t2 * (2.0 / 5.0 + t2 * (2.0 / 7.0 + t2 * (2.0 / 9.0)))));
+    return exponent * 0.6931471805599453 + series;
+}
+
+/**
+ * Pick the bytes the calling thread allocates before its next sample
+ *
+ * Exponentially distributed with PROF_RATE as the mean, so every byte has
+ * the same chance to be sampled however the allocations are sized.
+ */
+static void prof_next(void) {
+    if (PROF_RATE == 0) {
+        PROF_COUNTDOWN = INT64_MAX;
+        return;
+    }
+
+    if (PROF_RANDOM == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        PROF_RANDOM = prof_mix((uintptr_t)&PROF_RANDOM ^ (uint64_t)ts.tv_nsec) | 1;
+    }
+    PROF_RANDOM ^= PROF_RANDOM << 13;
+    PROF_RANDOM ^= PROF_RANDOM >> 7;
+    PROF_RANDOM ^= PROF_RANDOM << 17;
+
+    // Uniform in (0, 1], never zero
+    double u = ((PROF_RANDOM >> 11) + 1) * (1.0 / 9007199254740992.0);
+    PROF_COUNTDOWN = (int64_t)(-prof_log(u) * (double)PROF_RATE) + 1;
+}
+
+/**
+ * Find or add the stack table entry of a call stack
+ *
+ * The caller must hold PROF_LOCK.
+ *
+ * @param pcs The frames
+ * @param depth How many frames there are
+ * @return The index of the entry, or PROF_STACKS if the table is full
+ */
+static uint32_t stack_find(void **pcs, int depth) {
+    uint64_t hash = (uint64_t)depth;
+    for (int i = 0; i < depth; i++) {
+        hash = prof_mix(hash ^ (uintptr_t)pcs[i]);
+    }
+    hash |= 1;
+
+    for (uint32_t probe = 0; probe < PROF_STACKS; probe++) {
+        uint32_t i = (uint32_t)(hash + probe) & (PROF_STACKS - 1);
+        prof_stack *s = &STACKS[i];
+        if (s->hash == 0) {
+            s->hash = hash;
+            s->depth = (uint32_t)depth;
+            memcpy(s->pcs, pcs, depth * sizeof(void *));
+            return i;
+        }
+        if (s->hash == hash && s->depth == (uint32_t)depth && memcmp(s->pcs, pcs, depth * sizeof(void *)) == 0) {
+            return i;
+        }
+    }
+    return PROF_STACKS;
+}
+
+/**
+ * Record a sampled block and pick the next sample
+ *
+ * Called when the countdown of the calling thread runs out, which is also
+ * how a thread starts sampling. The stack is captured before taking the
+ * lock. backtrace may allocate the first time it runs, and samples that
+ * would be taken from inside it are skipped.
+ *
+ * @param ptr The block
+ * @param size The requested bytes
+ */
+void prof_sample(void *ptr, size_t size) {
+    if (PROF_BUSY) {
+        return;
+    }
+    int counting = PROF_RANDOM != 0;
+    PROF_BUSY = 1;
+    prof_next();
+    if (PROF_RATE == 0 || ptr == NULL || !counting) {
+        PROF_BUSY = 0;
+        return;
+    }
+
+    void *pcs[PROF_DEPTH + 1];
+    int depth = backtrace(pcs, PROF_DEPTH + 1) - 1;
+    if (depth < 0) {
+        depth = 0;
+    }
+
+    pthread_mutex_lock(&PROF_LOCK);
+    uint32_t stack = stack_find(pcs + 1, depth);
+    if (stack == PROF_STACKS || SAMPLE_SLOTS_USED >= PROF_SAMPLES / 4 * 3) {
+        DROPPED++;
+        pthread_mutex_unlock(&PROF_LOCK);
+        PROF_BUSY = 0;
+        return;
+    }
+
+    STACKS[stack].live_count++;
+    STACKS[stack].live_bytes += size;
+    STACKS[stack].total_count++;
+    STACKS[stack].total_bytes += size;
+
+    for (uint64_t i = prof_mix((uintptr_t)ptr);; i++) {
+        prof_sample_slot *slot = &SAMPLES[i & (PROF_SAMPLES - 1)];
+        if (slot->ptr == 0 || slot->ptr == PROF_TOMBSTONE) {
+            SAMPLE_SLOTS_USED += slot->ptr == 0;
+            slot->stack = stack;
+            slot->size = size;
+            __atomic_store_n(&slot->ptr, (uintptr_t)ptr, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&PROF_LOCK);
+    PROF_BUSY = 0;
+}
+
+/**
+ * Forget a block that is being freed, if it was sampled
+ *
+ * Probes the sample table without the lock: only the thread freeing a
+ * block removes it, and a slot is only emptied once no sample follows it,
+ * so the probe always reaches the block if it is there. Blocks that were
+ * not sampled never take the lock.
+ *
+ * @param ptr The block
+ */
+void prof_free(const void *ptr) {
+    prof_sample_slot *slot = NULL;
+    for (uint64_t i = prof_mix((uintptr_t)ptr);; i++) {
+        slot = &SAMPLES[i & (PROF_SAMPLES - 1)];
+        uintptr_t p = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+        if (p == 0) {
+            return;
+        }
+        if (p == (uintptr_t)ptr) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&PROF_LOCK);
+    STACKS[slot->stack].live_count--;
+    STACKS[slot->stack].live_bytes -= slot->size;
+    __atomic_store_n(&slot->ptr, PROF_TOMBSTONE, __ATOMIC_RELAXED);
+
+    // Tombstones at the end of a probe run can become empty slots again
+    size_t i = (size_t)(slot - SAMPLES);
+    if (SAMPLES[(i + 1) & (PROF_SAMPLES - 1)].ptr == 0) {
+        while (SAMPLES[i].ptr == PROF_TOMBSTONE) {
+            __atomic_store_n(&SAMPLES[i].ptr, 0, __ATOMIC_RELAXED);
+            SAMPLE_SLOTS_USED--;
+            i = (i - 1) & (PROF_SAMPLES - 1);
+        }
+    }
+    pthread_mutex_unlock(&PROF_LOCK);
+}
+
+/**
+ * Set up sampling when TUMALLOC_PROFILE asks for it
+ *
+ * The variable holds the mean number of bytes allocated between samples,
+ * 512 KB being a good start. TUMALLOC_PROFILE_FILE names a file the
+ * profile is written to at exit. Without a rate, or when the tables cannot
+ * be mapped, every thread's countdown is set out of reach on its first
+ * allocation and never runs out again.
+ *
+ * @param rate The value of TUMALLOC_PROFILE or of profile in TUMALLOC_CONF, 0 when neither is set
+ * @param path The prof_file of TUMALLOC_CONF, NULL to use TUMALLOC_PROFILE_FILE
+ */
+void prof_init(uint64_t rate, const char *path) {
+    if (rate == 0) {
+        return;
+    }
+
+    STACKS = mmap(NULL, PROF_STACKS * sizeof(prof_stack), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    SAMPLES = mmap(NULL, PROF_SAMPLES * sizeof(prof_sample_slot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (STACKS == MAP_FAILED || SAMPLES == MAP_FAILED) {
+        return;
+    }
+
+    if (path == NULL) {
+        path = getenv("TUMALLOC_PROFILE_FILE");
+    }
+    if (path != NULL && *path != '\0') {
+        PROF_PATH = path;
+    }
+    __atomic_store_n(&PROF_RATE, rate, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the profile lock before fork
+ */
+void prof_fork_lock(void) {
+    pthread_mutex_lock(&PROF_LOCK);
+}
+
+/**
+ * Release the profile lock after fork, in the parent and in the child
+ */
+void prof_fork_unlock(void) {
+    pthread_mutex_unlock(&PROF_LOCK);
+}
+
+/**
+ * Writes the sampled heap profile in the pprof legacy heap format
+ *
+ * Every stack that allocated sampled memory gets a line with its live
+ * blocks and bytes, then the blocks and bytes it ever allocated in
+ * brackets, then its frames. The header says the rate, so pprof scales
+ * the samples back up to whole-program estimates and shows either the
+ * live heap (inuse_space) or everything allocated (alloc_space). The
+ * memory map follows, for pprof to symbolize the frames. Does not allocate.
+ *
+ * @param fd The file descriptor to write to
+ * @return 0 on success, -1 if sampling is off or a write failed
+ */
+int tumalloc_profile(int fd) {
+    tumalloc_ensure_init();
+    if (__atomic_load_n(&PROF_RATE, __ATOMIC_ACQUIRE) == 0) {
+        return -1;
+    }
+
+    report r = {.fd = fd};
+    uint64_t totals[4] = {0, 0, 0, 0};
+
+    pthread_mutex_lock(&PROF_LOCK);
+    for (size_t i = 0; i < PROF_STACKS; i++) {
+        totals[0] += STACKS[i].live_count;
+        totals[1] += STACKS[i].live_bytes;
+        totals[2] += STACKS[i].total_count;
+        totals[3] += STACKS[i].total_bytes;
+    }
+    report_add(&r, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n", (unsigned long long)totals[0],
+               (unsigned long long)totals[1], (unsigned long long)totals[2], (unsigned long long)totals[3],
+               (unsigned long long)PROF_RATE);
+
+    for (size_t i = 0; i < PROF_STACKS; i++) {
+        prof_stack *s = &STACKS[i];
+        if (s->hash == 0) {
+            continue;
+        }
+        report_add(&r, "%llu: %llu [%llu: %llu] @", (unsigned long long)s->live_count,
+                   (unsigned long long)s->live_bytes, (unsigned long long)s->total_count,
+                   (unsigned long long)s->total_bytes);
+        for (uint32_t f = 0; f < s->depth; f++) {
+            report_add(&r, " %p", s->pcs[f]);
+        }
+        report_add(&r, "\n");
+    }
+    pthread_mutex_unlock(&PROF_LOCK);
+
+    report_add(&r, "\nMAPPED_LIBRARIES:\n");
+    report_flush(&r);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while ((n = read(maps, r.buf, sizeof(r.buf))) > 0) {
+            r.used = (size_t)n;
+            report_flush(&r);
+        }
+        close(maps);
+    }
+    return r.failed ? -1 : 0;
+}
+
+/**
+ * Write the profile to TUMALLOC_PROFILE_FILE when the process exits
+ */
+__attribute__((destructor)) static void prof_exit(void) {
+    if (PROF_PATH == NULL) {
+        return;
+    }
+
+    int fd = open(PROF_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        tumalloc_profile(fd);
+        close(fd);
+    }
+}
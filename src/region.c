@@ -0,0 +1,149 @@
+#include "alloc_internal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REGION_CHUNK_DEFAULT (64 * 1024) /**< Chunk size when the caller does not pick one */
+
+/**
+ * A chunk of a region, objects are bumped out of the space after it
+ */
+typedef struct region_chunk {
+    struct region_chunk *next; /**< Next chunk in the chain, kept across resets */
+    size_t size; /**< Bytes available for objects */
+} region_chunk;
+
+#define CHUNK_HEADER ((sizeof(region_chunk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) /**< Bytes before the objects of a chunk */
+
+/**
+ * A region: objects without headers, bumped out of a chain of chunks
+ *
+ * The chunks come from tumalloc, so the big ones get their own mapping.
+ * The chunk being bumped and every chunk after it in the chain have room,
+ * every chunk before it is full.
+ */
+struct tuarena {
+    region_chunk *first; /**< First chunk of the chain */
+    region_chunk *current; /**< Chunk objects are bumped out of */
+    char *ptr; /**< Next free byte of the current chunk */
+    char *end; /**< First byte after the current chunk */
+    size_t chunk_size; /**< Size of the chunks the region asks for */
+};
+
+/**
+ * Make a chunk the one objects are bumped out of
+ *
+ * @param r The region
+ * @param c The chunk
+ */
+static inline void chunk_use(tuarena *r, region_chunk *c) {
+    r->current = c;
+    r->ptr = (char *)c + CHUNK_HEADER;
+    r->end = r->ptr + c->size;
+}
+
+/**
+ * Creates a region
+ *
+ * The region is not thread-safe, every thread should use its own.
+ *
+ * @param chunk_size The size of the chunks the region grows by, 0 for 64 KB
+ * @return The region, or NULL if the OS is out of memory
+ */
+tuarena *tuarena_create(size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = REGION_CHUNK_DEFAULT;
+    }
+    if (chunk_size < CHUNK_HEADER + ALIGNMENT) {
+        chunk_size = CHUNK_HEADER + ALIGNMENT;
+    }
+
+    tuarena *r = tumalloc(sizeof(tuarena));
+    if (r == NULL) {
+        return NULL;
+    }
+    region_chunk *c = tumalloc(chunk_size);
+    if (c == NULL) {
+        tufree(r);
+        return NULL;
+    }
+
+    c->next = NULL;
+    c->size = chunk_size - CHUNK_HEADER;
+    r->first = c;
+    r->chunk_size = chunk_size;
+    chunk_use(r, c);
+    return r;
+}
+
+/**
+ * Allocates memory from a region
+ *
+ * Bumps a pointer, the object has no header and is only given back by
+ * tuarena_reset or tuarena_destroy. When the current chunk is full, the
+ * next chunk of the chain is used, and a new one is linked in after it
+ * when that one is too small. Requests larger than the chunk size get a
+ * chunk of their own.
+ *
+ * @param r The region
+ * @param size The amount of memory to allocate
+ * @return A pointer aligned to ALIGNMENT, or NULL if size is zero or the OS is out of memory
+ */
+void *tuarena_alloc(tuarena *r, size_t size) {
+    if (size == 0 || size > PTRDIFF_MAX - r->chunk_size) {
+        return NULL;
+    }
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if ((size_t)(r->end - r->ptr) < size) {
+        region_chunk *c = r->current->next;
+        if (c == NULL || c->size < size) {
+            size_t chunk_size = CHUNK_HEADER + size;
+            if (chunk_size < r->chunk_size) {
+                chunk_size = r->chunk_size;
+            }
+            c = tumalloc(chunk_size);
+            if (c == NULL) {
+                return NULL;
+            }
+            c->size = chunk_size - CHUNK_HEADER;
+            c->next = r->current->next;
+            r->current->next = c;
+        }
+        chunk_use(r, c);
+    }
+
+    void *ptr = r->ptr;
+    r->ptr += size;
+    return ptr;
+}
+
+/**
+ * Frees everything allocated from a region at once
+ *
+ * Keeps every chunk for the objects that come next, and only rewinds to the
+ * first one, so it takes the same time however much was allocated.
+ *
+ * @param r The region
+ */
+void tuarena_reset(tuarena *r) {
+    chunk_use(r, r->first);
+}
+
+/**
+ * Frees a region along with everything allocated from it
+ *
+ * @param r The region, or NULL
+ */
+void tuarena_destroy(tuarena *r) {
+    if (r == NULL) {
+        return;
+    }
+
+    for (region_chunk *c = r->first; c != NULL;) {
+        region_chunk *next = c->next;
+        tufree(c);
+        c = next;
+    }
+    tufree(r);
+}
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define SLAB_REGION_MAX (64UL << 30) /**< Address space we try to reserve for slabs */
+#define SLAB_REGION_MIN (256UL << 20) /**< Smallest reservation worth having */
+
+static char *SLAB_REGION_START = NULL; /**< Start of the reserved address range */
+static char *SLAB_REGION_END = NULL; /**< End of the part of the reserved range handed out as slabs */
+static char *SLAB_WRITABLE = NULL; /**< End of the part of the reserved range made writable */
+static char *REGION_LIMIT = NULL; /**< End of the reserved address range */
+static slab *SLAB_POOL = NULL; /**< Empty slabs given back by the arenas, linked through next */
+static size_t POOLED = 0; /**< Number of slabs in SLAB_POOL */
+static pthread_mutex_t REGION_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Protects SLAB_REGION_END and SLAB_POOL */
+
+/**
+ * Reserve the address range slabs are carved from
+ *
+ * The range is mapped without access rights and without swap reservation,
+ * so it costs nothing until a slab is carved out of it. We halve the request
+ * until the kernel accepts it. Without a region every small request falls
+ * back to the arenas. With huge pages on, the range is aligned to a huge
+ * page and advised for transparent huge pages, so slabs are packed into
+ * them.
+ */
+void slab_init(void) {
+    size_t align = HUGE_PAGES ? HUGE_PAGE_SIZE : SLAB_SIZE;
+
+    for (size_t size = SLAB_REGION_MAX; size >= SLAB_REGION_MIN; size /= 2) {
+        char *ptr = mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED) {
+            continue;
+        }
+
+        char *start = (char *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+        if (HUGE_PAGES) {
+            madvise(start, size, MADV_HUGEPAGE);
+        }
+        SLAB_REGION_START = start;
+        SLAB_REGION_END = start;
+        SLAB_WRITABLE = start;
+        REGION_LIMIT = start + size;
+        return;
+    }
+}
+
+/**
+ * Get an empty slab, reusing a pooled one before carving a new one
+ *
+ * A new slab is entered in the page map once and stays there, since slabs
+ * are never unmapped. The region is made writable a slab at a time, or a
+ * whole huge page at a time with huge pages on, so the kernel can back the
+ * page with a huge one on its first fault.
+ *
+ * @return The slab or NULL if the region is used up
+ */
+static slab *slab_take(void) {
+    slab *s = NULL;
+
+    pthread_mutex_lock(&REGION_LOCK);
+    if (SLAB_POOL != NULL) {
+        s = SLAB_POOL;
+        SLAB_POOL = s->next;
+        POOLED--;
+    } else if (SLAB_REGION_END != NULL && SLAB_REGION_END < REGION_LIMIT) {
+        char *ptr = SLAB_REGION_END;
+        if (ptr == SLAB_WRITABLE) {
+            size_t step = HUGE_PAGES ? HUGE_PAGE_SIZE : SLAB_SIZE;
+            if (mprotect(ptr, step, PROT_READ | PROT_WRITE) == 0) {
+                SLAB_WRITABLE = ptr + step;
+            }
+        }
+        if (ptr < SLAB_WRITABLE && pagemap_set(ptr, SLAB_SIZE, (uintptr_t)ptr | PAGE_SLAB)) {
+            s = (slab *)ptr;
+            SLAB_REGION_END = ptr + SLAB_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&REGION_LOCK);
+
+    return s;
+}
+
+/**
+ * Set up a fresh slab for a size class and put it on the arena's list
+ *
+ * The capacity is the largest count whose objects still fit behind the
+ * header and the bitmap, which keeps the metadata below 1% of the slab for
+ * every small class.
+ *
+ * @param a The arena that will own the slab
+ * @param cls The small size class of the objects
+ * @return The slab or NULL if no slab is left
+ */
+static slab *slab_new(arena *a, unsigned cls) {
+    slab *s = slab_take();
+    if (s == NULL) {
+        return NULL;
+    }
+
+    size_t size = (size_t)(cls + 1) * ALIGNMENT;
+    size_t capacity = (SLAB_SIZE - sizeof(slab)) / size;
+    size_t offset;
+    for (;; capacity--) {
+        size_t words = (capacity + 63) / 64;
+        offset = (sizeof(slab) + words * sizeof(uint64_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+        if (offset + capacity * size <= SLAB_SIZE) {
+            break;
+        }
+    }
+
+    s->magic = SLAB_MAGIC;
+    s->cls = (uint16_t)cls;
+    s->arena = a->index;
+    s->size = (uint32_t)size;
+    s->reciprocal = (uint32_t)(((1ULL << 32) + size - 1) / size);
+    s->capacity = (uint32_t)capacity;
+    s->used = 0;
+    s->hint = 0;
+    s->objects = (char *)s + offset;
+
+    // Every object starts out free, the bits past the last object never are
+    size_t words = (capacity + 63) / 64;
+    for (size_t i = 0; i < words; i++) {
+        __atomic_store_n(&s->bitmap[i], ~0ULL, __ATOMIC_RELAXED);
+    }
+    if (capacity % 64 != 0) {
+        __atomic_store_n(&s->bitmap[words - 1], (1ULL << (capacity % 64)) - 1, __ATOMIC_RELAXED);
+    }
+
+    s->prev = NULL;
+    s->next = a->slabs[cls];
+    if (s->next != NULL) {
+        s->next->prev = s;
+    }
+    a->slabs[cls] = s;
+    a->slab_count[cls]++;
+
+    return s;
+}
+
+/**
+ * Take a slab off the list of its arena
+ *
+ * @param a The arena owning the slab
+ * @param s The slab to unlink
+ */
+static void slab_unlink(arena *a, slab *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        a->slabs[s->cls] = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+/**
+ * Allocate a batch of objects of one small size class
+ *
+ * Objects come from the first slab on the arena's list, creating one when
+ * the list is empty. Whole bitmap words are taken at once when the batch has
+ * room for every free object in them, otherwise one ctz per object. A slab
+ * that runs full leaves the list until one of its objects is freed. Bitmap
+ * words are stored atomically because tufree reads them without the lock.
+ * The caller must hold the arena lock.
+ *
+ * @param a The arena to allocate from
+ * @param cls The small size class
+ * @param out Where the object pointers go
+ * @param count How many objects to allocate
+ * @return How many objects were allocated, zero if no slab is left
+ */
+unsigned slab_alloc(arena *a, unsigned cls, void **out, unsigned count) {
+    unsigned n = 0;
+
+    while (n < count) {
+        slab *s = a->slabs[cls];
+        if (s == NULL && (s = slab_new(a, cls)) == NULL) {
+            break;
+        }
+
+        size_t words = (s->capacity + 63) / 64;
+        size_t w = s->hint;
+        for (; w < words && n < count; w++) {
+            uint64_t bits = s->bitmap[w];
+            if (bits == 0) {
+                continue;
+            }
+
+            unsigned take = (unsigned)__builtin_popcountll(bits);
+            if (take <= count - n) {
+                __atomic_store_n(&s->bitmap[w], 0, __ATOMIC_RELAXED);
+            } else {
+                take = count - n;
+            }
+
+            s->used += take;
+            for (unsigned i = 0; i < take; i++) {
+                unsigned bit = (unsigned)__builtin_ctzll(bits);
+                bits &= bits - 1;
+                out[n++] = s->objects + (w * 64 + bit) * (size_t)s->size;
+            }
+            if (s->bitmap[w] != 0) {
+                __atomic_store_n(&s->bitmap[w], bits, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        s->hint = (uint32_t)w;
+
+        if (s->used == s->capacity) {
+            slab_unlink(a, s);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Return objects that share a bitmap word to their slab
+ *
+ * A slab that was full goes back on the arena's list. A slab that becomes
+ * empty goes back to the shared pool with its pages dropped, unless it is the
+ * last one of its class in the arena. Objects whose bit is already set are
+ * double frees and are ignored. The caller must hold the lock of the arena
+ * owning the slab.
+ *
+ * @param a The arena owning the slab
+ * @param s The slab
+ * @param word The bitmap word of the objects
+ * @param mask One bit per object to free
+ * @return How many objects were freed
+ */
+unsigned slab_free_mask(arena *a, slab *s, size_t word, uint64_t mask) {
+    mask &= ~s->bitmap[word];
+    if (mask == 0) {
+        return 0;
+    }
+
+    if (s->used == s->capacity) {
+        s->prev = NULL;
+        s->next = a->slabs[s->cls];
+        if (s->next != NULL) {
+            s->next->prev = s;
+        }
+        a->slabs[s->cls] = s;
+    }
+
+    unsigned n = (unsigned)__builtin_popcountll(mask);
+    __atomic_store_n(&s->bitmap[word], s->bitmap[word] | mask, __ATOMIC_RELAXED);
+    s->used -= n;
+    if (s->hint > word) {
+        s->hint = (uint32_t)word;
+    }
+
+    if (s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+        slab_unlink(a, s);
+        a->slab_count[s->cls]--;
+
+        // Keep the header page, drop the object pages unless that would split a huge page
+        if (!HUGE_PAGES) {
+            char *start = (char *)(((uintptr_t)s->objects + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+            madvise(start, (char *)s + SLAB_SIZE - start, MADV_DONTNEED);
+        }
+
+        pthread_mutex_lock(&REGION_LOCK);
+        s->next = SLAB_POOL;
+        SLAB_POOL = s;
+        POOLED++;
+        pthread_mutex_unlock(&REGION_LOCK);
+    }
+
+    return n;
+}
+
+/**
+ * Return an object to its slab
+ *
+ * The caller must hold the lock of the arena owning the slab.
+ *
+ * @param a The arena owning the slab
+ * @param ptr The object to free
+ */
+void slab_free(arena *a, void *ptr) {
+    slab *s = slab_of(ptr);
+    size_t index = slab_index(s, ptr);
+    slab_free_mask(a, s, index / 64, 1ULL << (index % 64));
+}
+
+/**
+ * Take the region lock before fork, so the child never sees it held
+ */
+void slab_fork_lock(void) {
+    pthread_mutex_lock(&REGION_LOCK);
+}
+
+/**
+ * Release the region lock after fork, in the parent and in the child
+ */
+void slab_fork_unlock(void) {
+    pthread_mutex_unlock(&REGION_LOCK);
+}
+
+/**
+ * Report how much of the slab region is in use
+ *
+ * @param carved Where the bytes of all slabs carved so far go
+ * @param pooled Where the bytes of the empty slabs in the pool go
+ */
+void slab_region_stats(size_t *carved, size_t *pooled) {
+    pthread_mutex_lock(&REGION_LOCK);
+    *carved = SLAB_REGION_END - SLAB_REGION_START;
+    *pooled = POOLED * SLAB_SIZE;
+    pthread_mutex_unlock(&REGION_LOCK);
+}
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+__thread thread_stats THREAD_STATS;
+large_stats LARGE_STATS;
+
+static thread_stats *LIVE_THREADS = NULL; /**< Counters of every registered thread */
+static thread_stats RETIRED; /**< Counters folded in by threads that exited */
+static pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Protects LIVE_THREADS and RETIRED */
+
+/**
+ * Make the calling thread's counters visible to readers
+ */
+void stats_register(void) {
+    pthread_mutex_lock(&STATS_LOCK);
+    THREAD_STATS.prev = NULL;
+    THREAD_STATS.next = LIVE_THREADS;
+    if (LIVE_THREADS != NULL) {
+        LIVE_THREADS->prev = &THREAD_STATS;
+    }
+    LIVE_THREADS = &THREAD_STATS;
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Fold the calling thread's counters into the retired total
+ *
+ * Runs at thread exit, before the thread-local memory goes away.
+ */
+void stats_unregister(void) {
+    pthread_mutex_lock(&STATS_LOCK);
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        RETIRED.allocs[cls] += THREAD_STATS.allocs[cls];
+        RETIRED.frees[cls] += THREAD_STATS.frees[cls];
+    }
+    RETIRED.cache_misses += THREAD_STATS.cache_misses;
+    RETIRED.cache_flushes += THREAD_STATS.cache_flushes;
+
+    if (THREAD_STATS.prev != NULL) {
+        THREAD_STATS.prev->next = THREAD_STATS.next;
+    } else {
+        LIVE_THREADS = THREAD_STATS.next;
+    }
+    if (THREAD_STATS.next != NULL) {
+        THREAD_STATS.next->prev = THREAD_STATS.prev;
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Take the stats lock before fork, so the child never sees it held
+ */
+void stats_fork_lock(void) {
+    pthread_mutex_lock(&STATS_LOCK);
+}
+
+/**
+ * Release the stats lock after fork, in the parent and in the child
+ */
+void stats_fork_unlock(void) {
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Get the largest block size of a size class
+ *
+ * @param cls The size class
+ * @return The largest size that maps to the class, 0 for the unbounded last class
+ */
+static size_t class_limit(unsigned cls) {
+    if (cls < SMALL_CLASS_COUNT) {
+        return (size_t)(cls + 1) * ALIGNMENT;
+    }
+    if (cls == NUM_SIZE_CLASSES - 1) {
+        return 0;
+    }
+
+    unsigned order = (cls - SMALL_CLASS_COUNT) / CLASS_SUBDIVISIONS + 9;
+    unsigned sub = (cls - SMALL_CLASS_COUNT) % CLASS_SUBDIVISIONS;
+    return ((size_t)1 << order) + (size_t)(sub + 1) * ((size_t)1 << (order - 2));
+}
+
+/**
+ * Add one thread's counters to a snapshot
+ *
+ * @param stats The snapshot
+ * @param t The counters
+ */
+static void add_thread(tustats *stats, const thread_stats *t) {
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        stats->classes[cls].allocs += __atomic_load_n(&t->allocs[cls], __ATOMIC_RELAXED);
+        stats->classes[cls].frees += __atomic_load_n(&t->frees[cls], __ATOMIC_RELAXED);
+    }
+    stats->cache_misses += __atomic_load_n(&t->cache_misses, __ATOMIC_RELAXED);
+    stats->cache_flushes += __atomic_load_n(&t->cache_flushes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add one free heap block to a snapshot
+ *
+ * @param stats The snapshot
+ * @param block The free block
+ */
+static void add_free_block(tustats *stats, const free_block *block) {
+    stats->classes[size_to_class(block->size)].free_blocks++;
+    stats->free_blocks++;
+    stats->free_bytes += block->size;
+    if (block->size > stats->largest_free) {
+        stats->largest_free = block->size;
+    }
+}
+
+/**
+ * Add every block of a free tree to a snapshot
+ *
+ * @param stats The snapshot
+ * @param t The subtree, or NULL
+ */
+static void add_tree(tustats *stats, const tree_block *t) {
+    for (; t != NULL; t = t->right) {
+        add_tree(stats, t->left);
+        add_free_block(stats, &t->block);
+    }
+}
+
+/**
+ * Add one arena to a snapshot
+ *
+ * Walks the free lists, the free trees and the slab lists, so it holds the
+ * arena lock for a while. The caller must hold that lock.
+ *
+ * @param stats The snapshot
+ * @param a The arena
+ * @param slab_objects Where the live slab objects handed out without a cache are added, per class
+ */
+static void add_arena(tustats *stats, arena *a, uint64_t *slab_objects) {
+    stats->heap += a->heap_size;
+    stats->allocated += a->allocated;
+    stats->top_allocs += a->top_allocs;
+    stats->grow_calls += a->grow_calls;
+    stats->syscalls_avoided += a->syscalls_avoided;
+    stats->trim_calls += a->trim_calls;
+    stats->bytes_returned += a->bytes_returned;
+    stats->purge_calls += a->purge_calls;
+    stats->bytes_purged += a->bytes_purged;
+    stats->lock_acquisitions += a->lock_acquisitions;
+    stats->lock_contended += __atomic_load_n(&a->contended, __ATOMIC_RELAXED);
+
+    for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        stats->classes[cls].allocs += a->allocs[cls];
+        stats->classes[cls].frees += a->frees[cls];
+    }
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        for (free_block *block = a->bins[cls]; block != NULL; block = block->next) {
+            add_free_block(stats, block);
+        }
+    }
+    for (unsigned cls = SMALL_CLASS_COUNT; cls < NUM_SIZE_CLASSES; cls++) {
+        add_tree(stats, a->trees[cls - SMALL_CLASS_COUNT]);
+    }
+
+    if (a->top != NULL) {
+        stats->free_blocks++;
+        stats->free_bytes += a->top->size;
+        if (a->top->size > stats->largest_free) {
+            stats->largest_free = a->top->size;
+        }
+    }
+
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        stats->classes[cls].allocs += a->uncached_allocs[cls];
+        stats->classes[cls].frees += a->uncached_frees[cls];
+        slab_objects[cls] += a->uncached_allocs[cls] - a->uncached_frees[cls];
+        stats->classes[cls].slabs += a->slab_count[cls];
+        stats->slab += (size_t)a->slab_count[cls] * SLAB_SIZE;
+
+        for (slab *s = a->slabs[cls]; s != NULL; s = s->next) {
+            stats->classes[cls].free_blocks += s->capacity - s->used;
+        }
+    }
+}
+
+/**
+ * Count the transparent huge pages backing heap and slab memory
+ *
+ * Reads /proc/self/smaps a buffer at a time, without allocating, and adds
+ * up AnonHugePages over the mappings whose first page the page map puts in
+ * an arena heap or a slab.
+ *
+ * @return The number of huge pages
+ */
+static size_t count_huge_pages(void) {
+    int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    char buf[4096];
+    size_t used = 0;
+    size_t kb = 0;
+    int ours = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + used, sizeof(buf) - used)) > 0) {
+        used += (size_t)n;
+        char *line = buf;
+        char *end;
+        while ((end = memchr(line, '\n', buf + used - line)) != NULL) {
+            *end = '\0';
+            if (strncmp(line, "AnonHugePages:", 14) == 0) {
+                if (ours) {
+                    kb += strtoul(line + 14, NULL, 10);
+                }
+            } else {
+                // A mapping starts with its address range, the fields after it start with a name
+                char *dash;
+                uintptr_t start = strtoul(line, &dash, 16);
+                if (dash != line && *dash == '-') {
+                    uintptr_t tag = pagemap_get((void *)start) & PAGE_TAG_MASK;
+                    ours = tag == PAGE_HEAP || tag == PAGE_SLAB;
+                }
+            }
+            line = end + 1;
+        }
+        used -= (size_t)(line - buf);
+        memmove(buf, line, used);
+        if (used == sizeof(buf)) {
+            used = 0;
+        }
+    }
+    close(fd);
+    return kb / (HUGE_PAGE_SIZE >> 10);
+}
+
+/**
+ * Takes a snapshot of the allocator state
+ *
+ * Per-thread counters are added up here rather than kept in shared
+ * memory, and each arena is locked only while it is being read, so the
+ * snapshot is not atomic as a whole. Blocks other threads freed into an
+ * arena are taken back before it is read.
+ *
+ * @param stats Where the snapshot goes
+ */
+void tumalloc_stats(tustats *stats) {
+    uint64_t slab_objects[SMALL_CLASS_COUNT];
+
+    tumalloc_ensure_init();
+    memset(stats, 0, sizeof(*stats));
+    memset(slab_objects, 0, sizeof(slab_objects));
+    for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        stats->classes[cls].size = class_limit(cls);
+    }
+
+    pthread_mutex_lock(&STATS_LOCK);
+    add_thread(stats, &RETIRED);
+    for (thread_stats *t = LIVE_THREADS; t != NULL; t = t->next) {
+        add_thread(stats, t);
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    // Everything counted so far is a slab object in a thread cache's class
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        slab_objects[cls] += stats->classes[cls].allocs - stats->classes[cls].frees;
+    }
+
+    stats->arenas = NUM_ARENAS;
+    for (unsigned i = 0; i < NUM_ARENAS; i++) {
+        arena *a = &ARENAS[i];
+        pthread_mutex_lock(&a->lock);
+        // Blocks waiting on the remote list are free as far as anyone knows
+        remote_drain(a);
+        add_arena(stats, a, slab_objects);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    for (unsigned cls = 0; cls < SMALL_CLASS_COUNT; cls++) {
+        stats->allocated += slab_objects[cls] * class_limit(cls);
+    }
+
+    size_t carved;
+    slab_region_stats(&carved, &stats->slab_pooled);
+    if (HUGE_PAGES) {
+        stats->huge_pages = count_huge_pages();
+    }
+
+    stats->large = __atomic_load_n(&LARGE_STATS.bytes, __ATOMIC_RELAXED);
+    stats->large_count = __atomic_load_n(&LARGE_STATS.count, __ATOMIC_RELAXED);
+    stats->mmap_calls = __atomic_load_n(&LARGE_STATS.mmap_calls, __ATOMIC_RELAXED);
+    stats->munmap_calls = __atomic_load_n(&LARGE_STATS.munmap_calls, __ATOMIC_RELAXED);
+    stats->mremap_calls = __atomic_load_n(&LARGE_STATS.mremap_calls, __ATOMIC_RELAXED);
+    stats->allocated += stats->large - stats->large_count * sizeof(header);
+
+    stats->active = stats->heap - stats->free_bytes + stats->slab + stats->large;
+    stats->mapped = stats->heap + carved + stats->large;
+    if (stats->free_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / (double)stats->free_bytes;
+    }
+}
+
+/**
+ * Write out everything buffered in a report
+ *
+ * @param r The report
+ */
+void report_flush(report *r) {
+    size_t done = 0;
+    while (done < r->used && !r->failed) {
+        ssize_t n = write(r->fd, r->buf + done, r->used - done);
+        if (n <= 0) {
+            r->failed = 1;
+        } else {
+            done += (size_t)n;
+        }
+    }
+    r->used = 0;
+}
+
+/**
+ * Append formatted text to a report
+ *
+ * @param r The report
+ * @param format A printf format, whose output must stay below 256 bytes
+ */
+void report_add(report *r, const char *format, ...) {
+    if (sizeof(r->buf) - r->used < 256) {
+        report_flush(r);
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(r->buf + r->used, sizeof(r->buf) - r->used, format, args);
+    va_end(args);
+    if (n > 0) {
+        r->used += (size_t)n < sizeof(r->buf) - r->used ? (size_t)n : sizeof(r->buf) - r->used - 1;
+    }
+}
+
+/**
+ * Writes a report of the allocator state
+ *
+ * The text format is meant for people, the JSON format holds the same
+ * fields under the names used in tustats.
+ *
+ * @param fd The file descriptor to write to
+ * @param format TUMALLOC_INFO_TEXT or TUMALLOC_INFO_JSON
+ * @return 0 on success, -1 for an unknown format or a failed write
+ */
+int tumalloc_info(int fd, int format) {
+    if (format != TUMALLOC_INFO_TEXT && format != TUMALLOC_INFO_JSON) {
+        return -1;
+    }
+
+    tustats stats;
+    tumalloc_stats(&stats);
+
+    const struct {
+        const char *name;
+        uint64_t value;
+    } fields[] = {
+        {"allocated", stats.allocated},
+        {"active", stats.active},
+        {"mapped", stats.mapped},
+        {"heap", stats.heap},
+        {"slab", stats.slab},
+        {"slab_pooled", stats.slab_pooled},
+        {"large", stats.large},
+        {"large_count", stats.large_count},
+        {"free_bytes", stats.free_bytes},
+        {"free_blocks", stats.free_blocks},
+        {"largest_free", stats.largest_free},
+        {"cache_misses", stats.cache_misses},
+        {"cache_flushes", stats.cache_flushes},
+        {"top_allocs", stats.top_allocs},
+        {"grow_calls", stats.grow_calls},
+        {"syscalls_avoided", stats.syscalls_avoided},
+        {"trim_calls", stats.trim_calls},
+        {"bytes_returned", stats.bytes_returned},
+        {"purge_calls", stats.purge_calls},
+        {"bytes_purged", stats.bytes_purged},
+        {"mmap_calls", stats.mmap_calls},
+        {"munmap_calls", stats.munmap_calls},
+        {"mremap_calls", stats.mremap_calls},
+        {"lock_acquisitions", stats.lock_acquisitions},
+        {"lock_contended", stats.lock_contended},
+        {"huge_pages", stats.huge_pages},
+        {"arenas", stats.arenas},
+    };
+
+    report r = {.fd = fd};
+    int json = format == TUMALLOC_INFO_JSON;
+
+    report_add(&r, json ? "{" : "tumalloc statistics\n");
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        report_add(&r, json ? "\"%s\": %llu, " : "  %-18s %llu\n", fields[i].name, (unsigned long long)fields[i].value);
+    }
+    if (json) {
+        report_add(&r, "\"fragmentation\": %.4f, \"classes\": [", stats.fragmentation);
+    } else {
+        report_add(&r, "  %-18s %.4f\n", "fragmentation", stats.fragmentation);
+        report_add(&r, "size classes\n  %5s %10s %14s %14s %12s %12s %6s\n",
+                   "class", "size", "allocs", "frees", "live", "free_blocks", "slabs");
+    }
+
+    int first = 1;
+    for (unsigned cls = 0; cls < TUMALLOC_SIZE_CLASSES; cls++) {
+        tuclass_stats *c = &stats.classes[cls];
+        if (c->allocs == 0 && c->free_blocks == 0 && c->slabs == 0) {
+            continue;
+        }
+        if (json) {
+            report_add(&r, "%s{\"class\": %u, \"size\": %zu, \"allocs\": %llu, \"frees\": %llu, \"free_blocks\": %zu, \"slabs\": %zu}",
+                       first ? "" : ", ", cls, c->size, (unsigned long long)c->allocs, (unsigned long long)c->frees,
+                       c->free_blocks, c->slabs);
+        } else {
+            report_add(&r, "  %5u %10zu %14llu %14llu %12lld %12zu %6zu\n", cls, c->size, (unsigned long long)c->allocs,
+                       (unsigned long long)c->frees, (long long)(c->allocs - c->frees), c->free_blocks, c->slabs);
+        }
+        first = 0;
+    }
+    if (json) {
+        report_add(&r, "]}\n");
+    }
+
+    report_flush(&r);
+    return r.failed ? -1 : 0;
+}
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_RECORDS 1024 /**< Records a thread collects before writing them out */
+
+/**
+ * Records of one thread waiting to be written
+ *
+ * Only the owning thread appends. Whoever holds TRACE_LOCK may write out the
+ * records below count, which the owner publishes with a release store.
+ */
+typedef struct trace_buffer {
+    uint32_t count; /**< Records in the buffer */
+    uint32_t flushed; /**< Records already written out */
+    uint32_t thread; /**< Thread number put in every record */
+    struct trace_buffer *next; /**< Next buffer of a live thread */
+    struct trace_buffer *prev; /**< Previous buffer of a live thread */
+    trace_record records[TRACE_BUFFER_RECORDS]; /**< The records */
+} trace_buffer;
+
+int TRACE_ENABLED = 0;
+
+static int TRACE_FD = -1; /**< The trace file */
+static uint64_t TRACE_START = 0; /**< Clock reading recording times are relative to */
+static uint32_t NEXT_THREAD = 0; /**< Number of the next thread to record */
+static trace_buffer *BUFFERS = NULL; /**< Buffers of every thread that recorded something */
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Protects TRACE_FD writes and BUFFERS */
+static pthread_key_t TRACE_KEY; /**< Drops the buffer of a thread when it exits, whatever it allocated */
+
+static __thread trace_buffer *TRACE_BUFFER = NULL; /**< Buffer of the calling thread */
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+static inline uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Write all of a range to the trace file
+ *
+ * Stops recording when the file cannot take it, rather than writing a trace
+ * with holes. The caller must hold TRACE_LOCK.
+ *
+ * @param data The bytes to write
+ * @param length How many bytes to write
+ */
+static void trace_write(const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0 && TRACE_FD >= 0) {
+        ssize_t n = write(TRACE_FD, p, length);
+        if (n <= 0) {
+            TRACE_ENABLED = 0;
+            return;
+        }
+        p += n;
+        length -= (size_t)n;
+    }
+}
+
+/**
+ * Write out the records of a buffer that are not written yet
+ *
+ * The caller must hold TRACE_LOCK.
+ *
+ * @param b The buffer
+ */
+static void trace_flush(trace_buffer *b) {
+    uint32_t count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+    trace_write(&b->records[b->flushed], (count - b->flushed) * sizeof(trace_record));
+    b->flushed = count;
+}
+
+/**
+ * Write out and drop the buffer of an exiting thread
+ *
+ * The TRACE_KEY destructor. A thread that allocates again afterwards gets a
+ * new buffer, which is dropped on the next round of destructors or written
+ * out at process exit.
+ *
+ * @param arg The buffer
+ */
+static void trace_thread_exit(void *arg) {
+    trace_buffer *b = arg;
+
+    pthread_mutex_lock(&TRACE_LOCK);
+    trace_flush(b);
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        BUFFERS = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+    pthread_mutex_unlock(&TRACE_LOCK);
+
+    TRACE_BUFFER = NULL;
+    munmap(b, sizeof(trace_buffer));
+}
+
+/**
+ * Open the trace file named by TUMALLOC_TRACE and start recording
+ *
+ * Called once from the allocator's initialization. Without the variable, or
+ * when the file cannot be created, nothing is recorded and the allocation
+ * paths only pay for one predictable branch.
+ */
+void trace_init(void) {
+    const char *path = getenv("TUMALLOC_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    TRACE_FD = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (TRACE_FD < 0) {
+        return;
+    }
+    if (pthread_key_create(&TRACE_KEY, trace_thread_exit) != 0) {
+        close(TRACE_FD);
+        TRACE_FD = -1;
+        return;
+    }
+
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+
+    TRACE_ENABLED = 1;
+    TRACE_START = trace_clock();
+    trace_write(&header, sizeof(header));
+}
+
+/**
+ * Record one allocator call of the calling thread
+ *
+ * Appends to the thread's buffer without locking, and only takes the lock
+ * to write the buffer out once it is full. Allocations are recorded after
+ * they return and frees before they start, so an address is never recorded
+ * as handed out again before the call that gave it back.
+ *
+ * @param op One of the TRACE_ operations
+ * @param ptr The returned or freed pointer
+ * @param arg The old pointer or the alignment, see trace_record
+ * @param size The requested bytes
+ */
+void trace_event(uint32_t op, const void *ptr, uintptr_t arg, size_t size) {
+    trace_buffer *b = TRACE_BUFFER;
+
+    if (b == NULL) {
+        b = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) {
+            return;
+        }
+        b->thread = __atomic_fetch_add(&NEXT_THREAD, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&TRACE_LOCK);
+        b->next = BUFFERS;
+        if (BUFFERS != NULL) {
+            BUFFERS->prev = b;
+        }
+        BUFFERS = b;
+        pthread_mutex_unlock(&TRACE_LOCK);
+        // pthread_setspecific may allocate, which must find the buffer ready
+        TRACE_BUFFER = b;
+        pthread_setspecific(TRACE_KEY, b);
+    }
+
+    trace_record *r = &b->records[b->count];
+    r->time = trace_clock() - TRACE_START;
+    r->ptr = (uintptr_t)ptr;
+    r->arg = arg;
+    r->size = size;
+    r->thread = b->thread;
+    r->op = op;
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+
+    if (b->count == TRACE_BUFFER_RECORDS) {
+        pthread_mutex_lock(&TRACE_LOCK);
+        trace_flush(b);
+        __atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+        b->flushed = 0;
+        pthread_mutex_unlock(&TRACE_LOCK);
+    }
+}
+
+/**
+ * Stop recording in a forked child
+ *
+ * The child's copies of the buffers hold records the parent will write
+ * itself, and its calls would end up interleaved with the parent's in the
+ * same file.
+ */
+void trace_fork_child(void) {
+    TRACE_ENABLED = 0;
+    TRACE_BUFFER = NULL;
+    BUFFERS = NULL;
+    if (TRACE_FD >= 0) {
+        close(TRACE_FD);
+        TRACE_FD = -1;
+    }
+    pthread_mutex_init(&TRACE_LOCK, NULL);
+}
+
+/**
+ * Write out every buffer when the process exits
+ *
+ * Threads still running keep appending, but only records they published
+ * before this point make it into the file.
+ */
+__attribute__((destructor)) static void trace_exit(void) {
+    if (TRACE_FD < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&TRACE_LOCK);
+    for (trace_buffer *b = BUFFERS; b != NULL; b = b->next) {
+        trace_flush(b);
+    }
+    pthread_mutex_unlock(&TRACE_LOCK);
+}
@@ -0,0 +1,42 @@
+#ifndef CYB3053_PROJECT2_TRACE_H
+#define CYB3053_PROJECT2_TRACE_H
+
+#include <stdint.h>
+
+// File format of allocation traces, shared by the recorder and tureplay
+
+#define TRACE_MAGIC "TUTRACE" /**< First bytes of every trace file, NUL included */
+#define TRACE_VERSION 1 /**< Bumped whenever the record layout changes */
+
+#define TRACE_MALLOC 1 /**< tumalloc, size is the request */
+#define TRACE_CALLOC 2 /**< tucalloc, size is num times size */
+#define TRACE_REALLOC 3 /**< turealloc, arg is the old pointer or zero */
+#define TRACE_FREE 4 /**< tufree, or turealloc to zero bytes */
+#define TRACE_ALIGNED 5 /**< tualigned_alloc and friends, arg is the alignment */
+
+/**
+ * Start of a trace file
+ */
+typedef struct trace_header {
+    char magic[8]; /**< TRACE_MAGIC */
+    uint32_t version; /**< TRACE_VERSION */
+    uint32_t record_size; /**< sizeof(trace_record), to catch mismatched builds */
+} trace_header;
+
+/**
+ * One allocator call, as recorded
+ *
+ * Pointers only serve as ids: replay matches a free with the allocation that
+ * returned the same address. Records of different threads are written in
+ * per-thread batches, so the file is only ordered by time within a thread.
+ */
+typedef struct trace_record {
+    uint64_t time; /**< Nanoseconds since recording started */
+    uint64_t ptr; /**< Returned pointer, or the freed one for TRACE_FREE */
+    uint64_t arg; /**< Old pointer for TRACE_REALLOC, alignment for TRACE_ALIGNED */
+    uint64_t size; /**< Requested bytes */
+    uint32_t thread; /**< Small number identifying the calling thread */
+    uint32_t op; /**< One of the TRACE_ operations */
+} trace_record;
+
+#endif //CYB3053_PROJECT2_TRACE_H
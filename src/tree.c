@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include "alloc_internal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Check whether a node sorts before another, by size and then address
+ *
+ * @param x The first node
+ * @param y The second node
+ * @return Non-zero if x comes first
+ */
+static inline int tree_before(const tree_block *x, const tree_block *y) {
+    return x->block.size != y->block.size ? x->block.size < y->block.size : x < y;
+}
+
+/**
+ * Get the treap priority of a node, hashed from its address
+ *
+ * Hashing keeps the tree balanced in expectation without storing anything,
+ * and the same heap always gets the same shape.
+ *
+ * @param t The node
+ * @return The priority, larger ones sit closer to the root
+ */
+static inline uint32_t tree_priority(const tree_block *t) {
+    return (uint32_t)(((uintptr_t)t >> 4) * 0x9E3779B97F4A7C15ULL >> 32);
+}
+
+/**
+ * Pick the node with the lower address
+ *
+ * @param x A node or NULL
+ * @param y A node or NULL
+ * @return The lower of the two, ignoring NULL
+ */
+static inline tree_block *tree_lower(tree_block *x, tree_block *y) {
+    if (x == NULL) {
+        return y;
+    }
+    return y != NULL && y < x ? y : x;
+}
+
+/**
+ * Recompute the address range a node's subtree covers
+ *
+ * @param t The node, whose children are up to date
+ */
+static void tree_update(tree_block *t) {
+    t->lo = tree_lower(t, t->left != NULL ? t->left->lo : NULL);
+    t->lo = tree_lower(t->lo, t->right != NULL ? t->right->lo : NULL);
+    t->hi = t;
+    if (t->left != NULL && t->left->hi > t->hi) {
+        t->hi = t->left->hi;
+    }
+    if (t->right != NULL && t->right->hi > t->hi) {
+        t->hi = t->right->hi;
+    }
+}
+
+/**
+ * Add a node below a subtree root
+ *
+ * The nodes on the way down only widen their address range to take in the
+ * new node. Only the rotations need to look at the children again.
+ *
+ * @param root The subtree, or NULL
+ * @param n The node to add
+ * @return The new subtree root
+ */
+static tree_block *tree_insert_at(tree_block *root, tree_block *n) {
+    if (root == NULL) {
+        n->left = NULL;
+        n->right = NULL;
+        n->lo = n;
+        n->hi = n;
+        return n;
+    }
+
+    if (n < root->lo) {
+        root->lo = n;
+    }
+    if (n > root->hi) {
+        root->hi = n;
+    }
+
+    if (tree_before(n, root)) {
+        root->left = tree_insert_at(root->left, n);
+        if (tree_priority(root->left) > tree_priority(root)) {
+            // Rotate right, the new root covers what the old one did
+            tree_block *l = root->left;
+            root->left = l->right;
+            l->right = root;
+            l->lo = root->lo;
+            l->hi = root->hi;
+            tree_update(root);
+            return l;
+        }
+    } else {
+        root->right = tree_insert_at(root->right, n);
+        if (tree_priority(root->right) > tree_priority(root)) {
+            // Rotate left, the new root covers what the old one did
+            tree_block *r = root->right;
+            root->right = r->left;
+            r->left = root;
+            r->lo = root->lo;
+            r->hi = root->hi;
+            tree_update(root);
+            return r;
+        }
+    }
+
+    return root;
+}
+
+/**
+ * Join two subtrees where every node of the first sorts before the second
+ *
+ * @param x The first subtree, or NULL
+ * @param y The second subtree, or NULL
+ * @return The joined subtree
+ */
+static tree_block *tree_merge(tree_block *x, tree_block *y) {
+    if (x == NULL) {
+        return y;
+    }
+    if (y == NULL) {
+        return x;
+    }
+
+    if (tree_priority(x) > tree_priority(y)) {
+        x->right = tree_merge(x->right, y);
+        tree_update(x);
+        return x;
+    }
+    y->left = tree_merge(x, y->left);
+    tree_update(y);
+    return y;
+}
+
+/**
+ * Take a node out of a subtree
+ *
+ * Only the nodes whose address range ended at the removed node need to
+ * look at their children again.
+ *
+ * @param root The subtree holding the node
+ * @param n The node to take out
+ * @return The new subtree root
+ */
+static tree_block *tree_remove_at(tree_block *root, tree_block *n) {
+    if (root == n) {
+        return tree_merge(n->left, n->right);
+    }
+
+    if (tree_before(n, root)) {
+        root->left = tree_remove_at(root->left, n);
+    } else {
+        root->right = tree_remove_at(root->right, n);
+    }
+    if (root->lo == n || root->hi == n) {
+        tree_update(root);
+    }
+    return root;
+}
+
+/**
+ * Find the lowest addressed node of a subtree above an address
+ *
+ * Skips every subtree that lies wholly below the address and stops at one
+ * that lies wholly above it, but may still visit many nodes.
+ *
+ * @param t The subtree, or NULL
+ * @param after The address
+ * @return The node, or NULL if there is none
+ */
+static tree_block *tree_after(tree_block *t, uintptr_t after) {
+    if (t == NULL || (uintptr_t)t->hi <= after) {
+        return NULL;
+    }
+    if ((uintptr_t)t->lo > after) {
+        return t->lo;
+    }
+
+    tree_block *found = tree_after(t->left, after);
+    if ((uintptr_t)t > after) {
+        found = tree_lower(found, t);
+    }
+    return tree_lower(found, tree_after(t->right, after));
+}
+
+/**
+ * File a free block above SMALL_CLASS_MAX in the tree of its size class
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param a The arena owning the block
+ * @param block The block
+ */
+void tree_insert(arena *a, free_block *block) {
+    unsigned cls = size_to_class(block->size);
+    tree_block **root = &a->trees[cls - SMALL_CLASS_COUNT];
+
+    *root = tree_insert_at(*root, (tree_block *)block);
+    a->bin_map |= 1ULL << cls;
+}
+
+/**
+ * Take a free block out of the tree of its size class
+ *
+ * The block must still have the size it was filed under. The caller must
+ * hold the arena lock.
+ *
+ * @param a The arena owning the block
+ * @param block The block
+ */
+void tree_remove(arena *a, free_block *block) {
+    unsigned cls = size_to_class(block->size);
+    tree_block **root = &a->trees[cls - SMALL_CLASS_COUNT];
+
+    *root = tree_remove_at(*root, (tree_block *)block);
+    if (*root == NULL) {
+        a->bin_map &= ~(1ULL << cls);
+    }
+}
+
+/**
+ * Find a free block of at least size bytes in an arena's trees
+ *
+ * Blocks in the classes above the request's own class all fit, and so do
+ * the nodes of its own class from the smallest fitting one on, which one
+ * descent visits: each node on the way that fits, plus its right subtree.
+ * Best fit takes the smallest of them, lowest address first on a tie,
+ * which is the smallest block of the next class when the request's own
+ * class has none. First fit takes the lowest address, and next fit the
+ * lowest address past the block it handed out last, wrapping around to
+ * first fit. Those two look at every non-empty larger class. The block is
+ * left in its tree. The caller must hold the arena lock.
+ *
+ * @param a The arena to search
+ * @param size The aligned size to look for
+ * @param policy TUMALLOC_FIT_BEST, TUMALLOC_FIT_FIRST or TUMALLOC_FIT_NEXT
+ * @return A block of at least size bytes or NULL if there is none
+ */
+free_block *tree_find(arena *a, size_t size, int policy) {
+    unsigned cls = size_to_class(size);
+    if (cls < SMALL_CLASS_COUNT) {
+        cls = SMALL_CLASS_COUNT;
+    }
+
+    tree_block *found = NULL;
+    tree_block *wrapped = NULL;
+
+    for (tree_block *t = a->trees[cls - SMALL_CLASS_COUNT]; t != NULL;) {
+        if (t->block.size < size) {
+            t = t->right;
+            continue;
+        }
+
+        if (policy == TUMALLOC_FIT_BEST) {
+            found = t;
+        } else {
+            wrapped = tree_lower(wrapped, tree_lower(t, t->right != NULL ? t->right->lo : NULL));
+            if (policy == TUMALLOC_FIT_NEXT) {
+                if ((uintptr_t)t > a->rover) {
+                    found = tree_lower(found, t);
+                }
+                found = tree_lower(found, tree_after(t->right, a->rover));
+            }
+        }
+        t = t->left;
+    }
+
+    uint64_t larger = cls < NUM_SIZE_CLASSES - 1 ? a->bin_map & (~0ULL << (cls + 1)) : 0;
+    if (policy == TUMALLOC_FIT_BEST) {
+        if (found == NULL && larger != 0) {
+            found = a->trees[__builtin_ctzll(larger) - SMALL_CLASS_COUNT];
+            while (found->left != NULL) {
+                found = found->left;
+            }
+        }
+        return (free_block *)found;
+    }
+
+    for (; larger != 0; larger &= larger - 1) {
+        tree_block *t = a->trees[__builtin_ctzll(larger) - SMALL_CLASS_COUNT];
+        wrapped = tree_lower(wrapped, t->lo);
+        if (policy == TUMALLOC_FIT_NEXT) {
+            found = tree_lower(found, tree_after(t, a->rover));
+        }
+    }
+
+    if (policy == TUMALLOC_FIT_FIRST || found == NULL) {
+        found = wrapped;
+    }
+    if (policy == TUMALLOC_FIT_NEXT && found != NULL) {
+        a->rover = (uintptr_t)found;
+    }
+    return (free_block *)found;
+}
@@ -0,0 +1,168 @@
+#ifndef CYB3053_PROJECT2_TUMALLOC_HPP
+#define CYB3053_PROJECT2_TUMALLOC_HPP
+
+#include "alloc.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+/*
+ * C++ access to the allocator: memory resources for the std::pmr
+ * containers and an allocator for the classic ones. Global operator new
+ * and delete live in libtumalloc_cxx.so, see new.cpp.
+ */
+
+namespace tu {
+
+/** Alignment every block gets without asking, the ALIGNMENT of the allocator */
+inline constexpr std::size_t natural_alignment = 16;
+
+/**
+ * A memory resource backed by tumalloc and tufree
+ */
+class heap_resource final : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *ptr = tualigned_alloc(alignment, bytes ? bytes : 1);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        tufree(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const heap_resource *>(&other) != nullptr;
+    }
+};
+
+/**
+ * Get the process wide heap resource
+ *
+ * @return The resource, usable with std::pmr::set_default_resource
+ */
+inline heap_resource *heap() noexcept {
+    static heap_resource resource;
+    return &resource;
+}
+
+/**
+ * A memory resource bump allocating from a region
+ *
+ * Deallocation does nothing, release() frees everything at once and keeps
+ * the chunks for what comes next. Like the region, it is not thread-safe.
+ */
+class region_resource final : public std::pmr::memory_resource {
+public:
+    /**
+     * Create the region
+     *
+     * @param chunk_size The size of the chunks it grows by, 0 for the default
+     */
+    explicit region_resource(std::size_t chunk_size = 0) : region_(tuarena_create(chunk_size)) {
+        if (region_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    region_resource(const region_resource &) = delete;
+    region_resource &operator=(const region_resource &) = delete;
+
+    ~region_resource() override {
+        tuarena_destroy(region_);
+    }
+
+    /**
+     * Free everything allocated from the resource, in constant time
+     */
+    void release() noexcept {
+        tuarena_reset(region_);
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        std::size_t padding = alignment > natural_alignment ? alignment - natural_alignment : 0;
+        void *ptr = tuarena_alloc(region_, (bytes ? bytes : 1) + padding);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<void *>((reinterpret_cast<std::uintptr_t>(ptr) + alignment - 1) & ~(alignment - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    tuarena *region_; /**< The region everything comes from */
+};
+
+/**
+ * An allocator for the standard containers backed by tumalloc
+ *
+ * Stateless, so all instances compare equal and containers can swap and
+ * move their memory freely.
+ *
+ * @tparam T The type of the objects
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U> &) noexcept {
+    }
+
+    /**
+     * Allocate room for n objects
+     *
+     * @param n How many objects
+     * @return Memory aligned for T
+     */
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void *ptr = tualigned_alloc(alignof(T), n ? n * sizeof(T) : 1);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    /**
+     * Free memory from allocate
+     *
+     * @param ptr The memory
+     * @param n The number of objects it was allocated for
+     */
+    void deallocate(T *ptr, std::size_t /*n*/) noexcept {
+        tufree(ptr);
+    }
+
+    template <class U>
+    friend bool operator==(const allocator &, const allocator<U> &) noexcept {
+        return true;
+    }
+
+    template <class U>
+    friend bool operator!=(const allocator &, const allocator<U> &) noexcept {
+        return false;
+    }
+};
+
+} // namespace tu
+
+#endif //CYB3053_PROJECT2_TUMALLOC_HPP
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "alloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Crash recovery of persistent heaps: a child fills a heap and is killed
+ * with SIGKILL before it can close it, then the heap is opened again. The
+ * root chain must be intact and the blocks freed before the crash must come
+ * back as one free block. A heap damaged on top of that must be refused and
+ * left byte for byte as it was.
+ */
+
+#define HEAP_PATH "pheap_crash.heap" /**< Heap file, in the working directory of the test */
+#define HEAP_SIZE (1024 * 1024) /**< Size of the heap */
+#define NODES 64 /**< Blocks the child allocates before filling the heap */
+#define KEPT 32 /**< Nodes on the root chain, the others are freed */
+#define NODE_SIZE 1000 /**< Bytes per node */
+
+/**
+ * A node of the chain hanging off the root
+ */
+typedef struct node {
+    uint64_t next; /**< Offset of the next node, zero at the end */
+    uint64_t value; /**< Position of the node in the chain */
+} node;
+
+/**
+ * Report a failed check and stop
+ *
+ * @param what What went wrong
+ */
+static void fail(const char *what) {
+    fprintf(stderr, "pheap_crash: %s\n", what);
+    unlink(HEAP_PATH);
+    exit(1);
+}
+
+/**
+ * Fill a heap and die without closing it, run in the child
+ *
+ * Keeps the first KEPT nodes on the root chain, fills all the space behind
+ * the nodes and frees the rest of them, so they are the only large free
+ * space when the heap is opened again.
+ */
+static void crash_writer(void) {
+    tuheap *h = tuheap_open(HEAP_PATH, HEAP_SIZE);
+    if (h == NULL) {
+        _exit(2);
+    }
+
+    node *nodes[NODES];
+    for (int i = 0; i < NODES; i++) {
+        nodes[i] = tuheap_alloc(h, NODE_SIZE);
+        if (nodes[i] == NULL) {
+            _exit(3);
+        }
+        nodes[i]->value = (uint64_t)i;
+        nodes[i]->next = 0;
+    }
+    for (int i = KEPT - 1; i > 0; i--) {
+        nodes[i - 1]->next = tuheap_offset(h, nodes[i]);
+    }
+    tuheap_set_root(h, nodes[0]);
+
+    // Nothing else may fit the freed nodes
+    for (size_t size = 4096; size >= 32; size /= 2) {
+        while (tuheap_alloc(h, size) != NULL) {
+        }
+    }
+    for (int i = KEPT; i < NODES; i++) {
+        tuheap_free(h, nodes[i]);
+    }
+
+    raise(SIGKILL);
+    _exit(4);
+}
+
+/**
+ * Run crash_writer in a child and check that it was killed
+ */
+static void run_writer(void) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fail("fork failed");
+    }
+    if (pid == 0) {
+        crash_writer();
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+        fail("writer did not die by SIGKILL");
+    }
+}
+
+/**
+ * Read the whole heap file
+ *
+ * @param size Where the size of the file goes
+ * @return The contents, from malloc
+ */
+static char *read_file(size_t *size) {
+    int fd = open(HEAP_PATH, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fail("cannot read the heap file");
+    }
+    char *data = malloc((size_t)st.st_size);
+    if (data == NULL || pread(fd, data, (size_t)st.st_size, 0) != st.st_size) {
+        fail("cannot read the heap file");
+    }
+    close(fd);
+    *size = (size_t)st.st_size;
+    return data;
+}
+
+int main(void) {
+    unlink(HEAP_PATH);
+    run_writer();
+
+    // The chain survives and the freed nodes are one block again
+    tuheap *h = tuheap_open(HEAP_PATH, HEAP_SIZE);
+    if (h == NULL) {
+        fail("heap not recovered");
+    }
+    uint64_t count = 0;
+    for (node *n = tuheap_root(h); n != NULL; n = tuheap_pointer(h, n->next)) {
+        if (n->value != count++) {
+            fail("root chain damaged");
+        }
+    }
+    if (count != KEPT) {
+        fail("root chain has the wrong length");
+    }
+    if (tuheap_alloc(h, (NODES - KEPT) * NODE_SIZE) == NULL) {
+        fail("freed space was not merged");
+    }
+    uint64_t last = 0;
+    for (node *n = tuheap_root(h); n != NULL; n = tuheap_pointer(h, n->next)) {
+        last = tuheap_offset(h, n);
+    }
+    if (tuheap_close(h) != 0) {
+        fail("close failed");
+    }
+
+    // Crash a fresh heap again, it has the same layout, and damage the header of the last node
+    unlink(HEAP_PATH);
+    run_writer();
+    int fd = open(HEAP_PATH, O_RDWR);
+    uint32_t bad = 0xDEADBEEF;
+    off_t magic = (off_t)(last - sizeof(header) + offsetof(header, magic));
+    if (fd < 0 || pwrite(fd, &bad, sizeof(bad), magic) != sizeof(bad)) {
+        fail("cannot damage the heap file");
+    }
+    close(fd);
+
+    size_t before_size, after_size;
+    char *before = read_file(&before_size);
+    errno = 0;
+    if (tuheap_open(HEAP_PATH, HEAP_SIZE) != NULL || errno != EUCLEAN) {
+        fail("damaged heap was opened");
+    }
+    char *after = read_file(&after_size);
+    if (before_size != after_size || memcmp(before, after, before_size) != 0) {
+        fail("damaged heap was changed");
+    }
+
+    free(before);
+    free(after);
+    unlink(HEAP_PATH);
+    printf("pheap_crash: ok\n");
+    return 0;
+}